@@ -0,0 +1,21 @@
+#!/bin/sh
+# Time each benchmark under the tree walker, the bytecode machine and
+# the machine with native code for hot lambdas
+# usage: bench/run.sh [path to prompt]
+prompt=${1:-./prompt}
+dir=$(dirname "$0")
+
+for b in "$dir"/*.lspy; do
+	for mode in tree vm jit; do
+		case $mode in
+			tree) flags="--eval tree" ;;
+			vm) flags="--eval vm --jit off" ;;
+			jit) flags="--eval vm" ;;
+		esac
+		start=$(date +%s.%N)
+		result=$("$prompt" $flags < "$b" | tail -n 2 | head -n 1 | sed 's/^lispy> //')
+		end=$(date +%s.%N)
+		printf "%-10s %-5s %6.3fs  %s\n" "$(basename "$b" .lspy)" $mode \
+			"$(awk "BEGIN { print $end - $start }")" "$result"
+	done
+done
@@ -4,10 +4,14 @@
 
 // Bring in the lval struct and lispy types
 #include "lval/base.h"
+// Allocation and memory statistics
+#include "lval/memory.h"
 // Error functionality
 #include "lval/error.h"
 // Adds functionality for the numeric data type
 #include "lval/numbers.h"
+// Integers beyond the range of a long
+#include "lval/bignum.h"
 // Adds functionality for the expression (Q or S) data type
 #include "lval/expressions.h"
 // Add read, write, and error functionality
@@ -18,5 +22,21 @@
 #include "lval/environment.h"
 // Add conditional statements
 #include "lval/conditionals.h"
+// Compile function bodies to bytecode and run them
+#include "lval/vm.h"
+// Fold constant expressions in lambda bodies
+#include "lval/fold.h"
+// Run hot integer lambdas as native code
+#include "lval/jit.h"
+// Share equal subtrees of bound values
+#include "lval/hashcons.h"
+// Memoize pure lambdas
+#include "lval/memo.h"
+// Delayed values and lazy sequences
+#include "lval/lazy.h"
+// Loops that run in one frame
+#include "lval/loop.h"
+// Macros expanded once per call
+#include "lval/macro.h"
 
 #endif
@@ -3,36 +3,86 @@
 
 struct lval;
 struct lenv;
+struct lcell;
+struct lcode;
+struct lbig;
+struct ljit;
+struct lparams;
+struct lfun;
+struct lmemo;
+struct lthunk;
 
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcell lcell;
+typedef struct lcode lcode;
+typedef struct lbig lbig;
+typedef struct ljit ljit;
+typedef struct lparams lparams;
+typedef struct lfun lfun;
+typedef struct lmemo lmemo;
+typedef struct lthunk lthunk;
 
 typedef lval* (*lbuiltin) (lenv*, lval*);
+// Builtins taking their arguments as a vector of values they own
+typedef lval* (*lbuiltin_v) (lenv*, int, lval**);
 
 typedef union typeval {
 	long num;
 	double dec;
+	// Integers too large for a long
+	lbig* big;
 	// Error and symbols contain string data
 	char* err;
 	char* sym;
+	// Delayed expressions, shared between copies
+	lthunk* thunk;
 } TypeVal;
 
 // A lispy value can either be a number, error, symbol, or an expression
 struct lval {
 	int type;
+	// Holders of a node shared by hash-consing, 0 for a value with one owner
+	int refs;
 	TypeVal data;
 
-	// Function
-	lbuiltin builtin;
-	lenv* env;
-	lval* formals;
-	lval* body;
+	// Symbol: hash of the name, computed once on creation
+	// Other shared nodes: their structural hash
+	unsigned long hash;
 
 	// Count and pointer to a list of lval*
 	int count;
 	lval** cell;
+
+	// What only some types need, kept apart by type
+	union {
+		// Symbol: lexical address as frames up and binding position,
+		// with the number of the formals whose calls it holds in, or
+		// else the cached global value cell
+		struct {
+			int depth;
+			int slot;
+			union {
+				long owner;
+				lcell* cache;
+			};
+		};
+		// List calling a macro: the code it expanded to, and the number
+		// of the macro it came from. List folded ahead of time: the code
+		// it folded to, with no macro, and the fold epoch it holds for
+		struct {
+			lval* expansion;
+			int macro;
+			int fold;
+		};
+		// Function: what it is, shared between copies
+		lfun* fun;
+	};
 };
 
 // Possible lispy value types
-enum { LVAL_ERR, LVAL_LONG, LVAL_DOUBLE, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUN };
+enum { LVAL_ERR, LVAL_LONG, LVAL_DOUBLE, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUN,
+	LVAL_BIGINT, LVAL_THUNK,
+	// Number of types, keep last
+	LVAL_NTYPES };
 #endif
@@ -0,0 +1,441 @@
+#include <string.h>
+#include <limits.h>
+#include "bignum.h"
+#include "numbers.h"
+#include "memory.h"
+
+// Below this many limbs multiplication is done the schoolbook way
+#define LBIG_KARATSUBA 32
+
+// NULL when the heap budget refuses the limbs, as every result below
+static lbig* lbig_alloc(int n) {
+	lbig* b = (lbig*) lmem_alloc(LVAL_BIGINT, sizeof(lbig) + sizeof(uint32_t) * (n ? n : 1));
+	if (b == NULL) { return NULL; }
+	memset(b->limb, 0, sizeof(uint32_t) * n);
+	b->sign = 1;
+	b->count = n;
+	return b;
+}
+
+// Drop leading zero limbs
+static lbig* lbig_trim(lbig* b) {
+	while (b->count > 0 && b->limb[b->count - 1] == 0) { b->count--; }
+	if (b->count == 0) { b->sign = 1; }
+	return b;
+}
+
+static uint32_t* lbig_scratch(int n) {
+	uint32_t* x = (uint32_t*) lmem_alloc(LVAL_BIGINT, sizeof(uint32_t) * (n ? n : 1));
+	if (x == NULL) { return NULL; }
+	memset(x, 0, sizeof(uint32_t) * n);
+	return x;
+}
+
+/*
+    Magnitudes
+    Unsigned numbers as limb arrays and their lengths. Inputs may carry
+    leading zero limbs.
+*/
+static int mag_len(const uint32_t* a, int n) {
+	while (n > 0 && a[n - 1] == 0) { n--; }
+	return n;
+}
+
+static int mag_cmp(const uint32_t* a, int na, const uint32_t* b, int nb) {
+	na = mag_len(a, na);
+	nb = mag_len(b, nb);
+	if (na != nb) { return na < nb ? -1 : 1; }
+	for (int i = na - 1; i >= 0; i--) {
+		if (a[i] != b[i]) { return a[i] < b[i] ? -1 : 1; }
+	}
+	return 0;
+}
+
+// a += b, where the sum fits in the na limbs of a
+static void mag_add_into(uint32_t* a, int na, const uint32_t* b, int nb) {
+	uint32_t carry = 0;
+	int i;
+	for (i = 0; i < nb; i++) {
+		uint32_t s = a[i] + b[i] + carry;
+		carry = s >= LBIG_BASE;
+		a[i] = carry ? s - LBIG_BASE : s;
+	}
+	for (; carry && i < na; i++) {
+		carry = a[i] == LBIG_BASE - 1;
+		a[i] = carry ? 0 : a[i] + 1;
+	}
+}
+
+// a -= b, where a is at least b
+static void mag_sub_into(uint32_t* a, int na, const uint32_t* b, int nb) {
+	int borrow = 0;
+	int i;
+	for (i = 0; i < nb; i++) {
+		int64_t d = (int64_t) a[i] - b[i] - borrow;
+		borrow = d < 0;
+		a[i] = borrow ? d + LBIG_BASE : d;
+	}
+	for (; borrow && i < na; i++) {
+		borrow = a[i] == 0;
+		a[i] = borrow ? LBIG_BASE - 1 : a[i] - 1;
+	}
+}
+
+// a *= f for a small factor, returning what carries out
+static uint32_t mag_mul1(uint32_t* a, int na, uint32_t f) {
+	uint64_t carry = 0;
+	for (int i = 0; i < na; i++) {
+		uint64_t t = (uint64_t) a[i] * f + carry;
+		a[i] = t % LBIG_BASE;
+		carry = t / LBIG_BASE;
+	}
+	return carry;
+}
+
+// q = a / d, returning the remainder
+static uint32_t mag_div1(const uint32_t* a, int na, uint32_t d, uint32_t* q) {
+	uint64_t r = 0;
+	for (int i = na - 1; i >= 0; i--) {
+		uint64_t t = r * LBIG_BASE + a[i];
+		q[i] = t / d;
+		r = t % d;
+	}
+	return r;
+}
+
+// out += a * b, out having na + nb limbs
+static void mag_mul_school(const uint32_t* a, int na, const uint32_t* b, int nb, uint32_t* out) {
+	for (int i = 0; i < na; i++) {
+		if (a[i] == 0) { continue; }
+		uint64_t carry = 0;
+		for (int j = 0; j < nb; j++) {
+			uint64_t t = (uint64_t) a[i] * b[j] + out[i + j] + carry;
+			out[i + j] = t % LBIG_BASE;
+			carry = t / LBIG_BASE;
+		}
+		for (int k = i + nb; carry; k++) {
+			uint64_t t = out[k] + carry;
+			out[k] = t % LBIG_BASE;
+			carry = t / LBIG_BASE;
+		}
+	}
+}
+
+// out = a * b, out having na + nb cleared limbs
+// 0 when the scratch space is refused
+static int mag_mul(const uint32_t* a, int na, const uint32_t* b, int nb, uint32_t* out) {
+	if (na < nb) {
+		const uint32_t* t = a; a = b; b = t;
+		int n = na; na = nb; nb = n;
+	}
+	if (nb < LBIG_KARATSUBA) {
+		mag_mul_school(a, na, b, nb, out);
+		return 1;
+	}
+
+	int m = na / 2;
+	if (nb <= m) {
+		// Lopsided operands: only the longer one is split
+		uint32_t* t = lbig_scratch(na - m + nb);
+		int ok = t && mag_mul(a, m, b, nb, out) && mag_mul(a + m, na - m, b, nb, t);
+		if (ok) { mag_add_into(out + m, na + nb - m, t, mag_len(t, na - m + nb)); }
+		lmem_free(t);
+		return ok;
+	}
+
+	// With a = a1 B^m + a0 and b = b1 B^m + b0, the middle term is
+	// (a0 + a1)(b0 + b1) - a0 b0 - a1 b1
+	int ns = na - m + 1;
+	int nt = (m > nb - m ? m : nb - m) + 1;
+	uint32_t* s = lbig_scratch(ns);
+	uint32_t* t = lbig_scratch(nt);
+	uint32_t* z = lbig_scratch(ns + nt);
+	int ok = s && t && z && mag_mul(a, m, b, m, out) &&
+		mag_mul(a + m, na - m, b + m, nb - m, out + 2 * m);
+	if (ok) {
+		memcpy(s, a + m, sizeof(uint32_t) * (na - m));
+		mag_add_into(s, ns, a, m);
+		memcpy(t, b + m, sizeof(uint32_t) * (nb - m));
+		mag_add_into(t, nt, b, m);
+		ok = mag_mul(s, ns, t, nt, z);
+	}
+	if (ok) {
+		mag_sub_into(z, ns + nt, out, 2 * m);
+		mag_sub_into(z, ns + nt, out + 2 * m, na + nb - 2 * m);
+		mag_add_into(out + m, na + nb - m, z, mag_len(z, ns + nt));
+	}
+
+	lmem_free(s);
+	lmem_free(t);
+	lmem_free(z);
+	return ok;
+}
+
+// Long division (Knuth, algorithm D) for divisors of two limbs or more
+// q gets na - nb + 1 limbs and r gets nb, 0 when the scratch space is refused
+static int mag_divmod(const uint32_t* a, int na, const uint32_t* b, int nb, uint32_t* q, uint32_t* r) {
+	// Scale both so that the top limb of the divisor is at least half the base
+	uint32_t d = LBIG_BASE / (b[nb - 1] + 1);
+	uint32_t* u = lbig_scratch(na + 1);
+	uint32_t* v = lbig_scratch(nb);
+	if (u == NULL || v == NULL) {
+		lmem_free(u);
+		lmem_free(v);
+		return 0;
+	}
+	memcpy(u, a, sizeof(uint32_t) * na);
+	memcpy(v, b, sizeof(uint32_t) * nb);
+	u[na] = mag_mul1(u, na, d);
+	mag_mul1(v, nb, d);
+
+	for (int j = na - nb; j >= 0; j--) {
+		// Estimate the quotient limb from the top two limbs, then correct it
+		uint64_t top = (uint64_t) u[j + nb] * LBIG_BASE + u[j + nb - 1];
+		uint64_t qhat = top / v[nb - 1];
+		uint64_t rhat = top % v[nb - 1];
+		while (qhat >= LBIG_BASE || qhat * v[nb - 2] > rhat * LBIG_BASE + u[j + nb - 2]) {
+			qhat--;
+			rhat += v[nb - 1];
+			if (rhat >= LBIG_BASE) { break; }
+		}
+
+		// u -= qhat * v, shifted by j
+		uint64_t carry = 0;
+		int borrow = 0;
+		for (int i = 0; i < nb; i++) {
+			uint64_t p = qhat * v[i] + carry;
+			carry = p / LBIG_BASE;
+			int64_t t = (int64_t) u[i + j] - (int64_t) (p % LBIG_BASE) - borrow;
+			borrow = t < 0;
+			u[i + j] = borrow ? t + LBIG_BASE : t;
+		}
+		int64_t t = (int64_t) u[j + nb] - (int64_t) carry - borrow;
+
+		// Taken once too often: add one v back
+		if (t < 0) {
+			u[j + nb] = t + LBIG_BASE;
+			qhat--;
+			uint32_t c = 0;
+			for (int i = 0; i < nb; i++) {
+				uint32_t s = u[i + j] + v[i] + c;
+				c = s >= LBIG_BASE;
+				u[i + j] = c ? s - LBIG_BASE : s;
+			}
+			u[j + nb] = (u[j + nb] + c) % LBIG_BASE;
+		} else {
+			u[j + nb] = t;
+		}
+		q[j] = qhat;
+	}
+
+	mag_div1(u, nb, d, r);
+	lmem_free(u);
+	lmem_free(v);
+	return 1;
+}
+
+/*
+    Signed numbers
+*/
+lbig* lbig_long(long x) {
+	unsigned long m = x < 0 ? -(unsigned long) x : (unsigned long) x;
+	lbig* b = lbig_alloc(3);
+	if (b == NULL) { return NULL; }
+	for (int i = 0; i < 3; i++) {
+		b->limb[i] = m % LBIG_BASE;
+		m /= LBIG_BASE;
+	}
+	b->sign = x < 0 ? -1 : 1;
+	return lbig_trim(b);
+}
+
+lbig* lbig_copy(lbig* b) {
+	lbig* x = lbig_alloc(b->count);
+	if (x == NULL) { return NULL; }
+	memcpy(x->limb, b->limb, sizeof(uint32_t) * b->count);
+	x->sign = b->sign;
+	return x;
+}
+
+void lbig_free(lbig* b) { lmem_free(b); }
+
+int lbig_fits(lbig* b, long* x) {
+	unsigned long m = 0;
+	for (int i = b->count - 1; i >= 0; i--) {
+		if (__builtin_mul_overflow(m, LBIG_BASE, &m) ||
+			__builtin_add_overflow(m, b->limb[i], &m)) { return 0; }
+	}
+	if (b->sign > 0 && m > (unsigned long) LONG_MAX) { return 0; }
+	if (b->sign < 0 && m > (unsigned long) LONG_MAX + 1) { return 0; }
+	*x = b->sign < 0 ? (long) -m : (long) m;
+	return 1;
+}
+
+lval* lval_bigint(lbig* b) {
+	if (b == NULL) { return lmem_err(); }
+	long x;
+	if (lbig_fits(b, &x)) {
+		lbig_free(b);
+		return lval_long(x);
+	}
+	lval* v = lval_alloc(LVAL_BIGINT);
+	v->data.big = b;
+	return v;
+}
+
+lbig* lbig_read(char* s) {
+	int sign = 1;
+	if (*s == '-') { sign = -1; s++; }
+	while (*s == '0') { s++; }
+
+	// Nine digits to a limb, from the right
+	int n = strlen(s);
+	lbig* b = lbig_alloc((n + LBIG_DIGITS - 1) / LBIG_DIGITS);
+	if (b == NULL) { return NULL; }
+	for (int i = 0; i < b->count; i++) {
+		int end = n - i * LBIG_DIGITS;
+		int start = end > LBIG_DIGITS ? end - LBIG_DIGITS : 0;
+		uint32_t limb = 0;
+		for (int k = start; k < end; k++) { limb = limb * 10 + (s[k] - '0'); }
+		b->limb[i] = limb;
+	}
+	b->sign = sign;
+	return lbig_trim(b);
+}
+
+void lbig_print(FILE* stream, lbig* b) {
+	if (b->count == 0) { fputc('0', stream); return; }
+	if (b->sign < 0) { fputc('-', stream); }
+	fprintf(stream, "%u", b->limb[b->count - 1]);
+	for (int i = b->count - 2; i >= 0; i--) { fprintf(stream, "%09u", b->limb[i]); }
+}
+
+double lbig_double(lbig* b) {
+	double x = 0;
+	for (int i = b->count - 1; i >= 0; i--) { x = x * LBIG_BASE + b->limb[i]; }
+	return b->sign * x;
+}
+
+int lbig_cmp(lbig* x, lbig* y) {
+	if (x->sign != y->sign) { return x->sign < y->sign ? -1 : 1; }
+	return x->sign * mag_cmp(x->limb, x->count, y->limb, y->count);
+}
+
+lbig* lbig_neg(lbig* x) {
+	lbig* r = lbig_copy(x);
+	if (r && r->count) { r->sign = -r->sign; }
+	return r;
+}
+
+// x + y with the sign of y taken as ysign
+static lbig* lbig_sum(lbig* x, lbig* y, int ysign) {
+	if (x->sign == ysign) {
+		int n = (x->count > y->count ? x->count : y->count) + 1;
+		lbig* r = lbig_alloc(n);
+		if (r == NULL) { return NULL; }
+		memcpy(r->limb, x->limb, sizeof(uint32_t) * x->count);
+		mag_add_into(r->limb, n, y->limb, y->count);
+		r->sign = x->sign;
+		return lbig_trim(r);
+	}
+
+	// Opposite signs: the smaller magnitude comes off the larger,
+	// whose sign the result takes
+	int sign = x->sign;
+	if (mag_cmp(x->limb, x->count, y->limb, y->count) < 0) {
+		lbig* t = x; x = y; y = t;
+		sign = ysign;
+	}
+	lbig* r = lbig_copy(x);
+	if (r == NULL) { return NULL; }
+	mag_sub_into(r->limb, r->count, y->limb, y->count);
+	r->sign = sign;
+	return lbig_trim(r);
+}
+
+lbig* lbig_add(lbig* x, lbig* y) { return lbig_sum(x, y, y->sign); }
+
+lbig* lbig_sub(lbig* x, lbig* y) { return lbig_sum(x, y, -y->sign); }
+
+lbig* lbig_mul(lbig* x, lbig* y) {
+	lbig* r = lbig_alloc(x->count + y->count);
+	if (r == NULL) { return NULL; }
+	if (x->count && y->count && !mag_mul(x->limb, x->count, y->limb, y->count, r->limb)) {
+		lbig_free(r);
+		return NULL;
+	}
+	r->sign = x->sign * y->sign;
+	return lbig_trim(r);
+}
+
+// 0 on division by zero; q and r are NULL when the memory is refused
+static int lbig_divmod(lbig* x, lbig* y, lbig** q, lbig** r) {
+	if (y->count == 0) { return 0; }
+
+	int ok;
+	if (mag_cmp(x->limb, x->count, y->limb, y->count) < 0) {
+		*q = lbig_alloc(0);
+		*r = lbig_copy(x);
+		ok = *q && *r;
+	} else {
+		*q = lbig_alloc(x->count - y->count + 1);
+		*r = lbig_alloc(y->count);
+		ok = *q && *r;
+		if (ok && y->count == 1) {
+			(*r)->limb[0] = mag_div1(x->limb, x->count, y->limb[0], (*q)->limb);
+		} else if (ok) {
+			ok = mag_divmod(x->limb, x->count, y->limb, y->count, (*q)->limb, (*r)->limb);
+		}
+		if (ok) {
+			(*q)->sign = x->sign * y->sign;
+			(*r)->sign = x->sign;
+			lbig_trim(*q);
+			lbig_trim(*r);
+		}
+	}
+	if (!ok) {
+		lbig_free(*q);
+		lbig_free(*r);
+		*q = *r = NULL;
+	}
+	return 1;
+}
+
+lbig* lbig_div(lbig* x, lbig* y) {
+	lbig *q, *r;
+	if (!lbig_divmod(x, y, &q, &r) || q == NULL) { return NULL; }
+	lbig_free(r);
+	return q;
+}
+
+lbig* lbig_mod(lbig* x, lbig* y) {
+	lbig *q, *r;
+	if (!lbig_divmod(x, y, &q, &r) || q == NULL) { return NULL; }
+	lbig_free(q);
+	return r;
+}
+
+// Exponentiation by squaring, for n of zero or more
+lbig* lbig_pow(lbig* x, long n) {
+	lbig* acc = lbig_long(1);
+	lbig* b = lbig_copy(x);
+	while (n > 0 && acc && b) {
+		if (n & 1) {
+			lbig* t = lbig_mul(acc, b);
+			lbig_free(acc);
+			acc = t;
+		}
+		n >>= 1;
+		if (n > 0 && acc) {
+			lbig* t = lbig_mul(b, b);
+			lbig_free(b);
+			b = t;
+		}
+	}
+	if (b == NULL) {
+		lbig_free(acc);
+		return NULL;
+	}
+	lbig_free(b);
+	return acc;
+}
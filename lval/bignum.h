@@ -0,0 +1,51 @@
+#ifndef LVAL_BIGNUM
+#define LVAL_BIGNUM
+#include <stdio.h>
+#include <stdint.h>
+#include "base.h"
+
+/*
+    Arbitrary precision integers
+    Longs that overflow become big integers, and results that fit in a
+    long become longs again, so a big integer is always out of the range
+    of a long. Digits are kept in base 10^9, least significant first,
+    which makes reading and printing decimal text linear.
+*/
+#define LBIG_BASE 1000000000u
+#define LBIG_DIGITS 9
+
+struct lbig {
+    // 1 or -1, zero is positive with no limbs
+    int sign;
+    int count;
+    uint32_t limb[];
+};
+
+// Takes b, giving a long when it fits, or the error for a NULL b
+lval* lval_bigint(lbig* b);
+
+lbig* lbig_long(long x);
+lbig* lbig_read(char* s);
+void lbig_print(FILE* stream, lbig* b);
+lbig* lbig_copy(lbig* b);
+void lbig_free(lbig* b);
+
+// Whether b fits in a long, stored in x when it does
+int lbig_fits(lbig* b, long* x);
+double lbig_double(lbig* b);
+int lbig_cmp(lbig* x, lbig* y);
+lbig* lbig_neg(lbig* x);
+
+// Results are new numbers, NULL on division by zero or when the heap
+// budget refuses the memory for them (lbig_long, lbig_read and
+// lbig_copy above included)
+// Division truncates, and the remainder takes the sign of the dividend
+typedef lbig* (*lbig_op)(lbig* x, lbig* y);
+lbig* lbig_add(lbig* x, lbig* y);
+lbig* lbig_sub(lbig* x, lbig* y);
+lbig* lbig_mul(lbig* x, lbig* y);
+lbig* lbig_div(lbig* x, lbig* y);
+lbig* lbig_mod(lbig* x, lbig* y);
+lbig* lbig_pow(lbig* x, long n);
+
+#endif
@@ -2,64 +2,130 @@
 #include "numbers.h"
 #include "operations.h"
 #include "expressions.h"
+#include "environment.h"
 #include "error.h"
+#include "memory.h"
+#include "bignum.h"
+#include "hashcons.h"
+#include "lazy.h"
 
-lval* builtin_gt(lenv* e, lval* a) {
-    return builtin_ord(e, a, ">");
+/*
+    Ordering of two numbers
+    Longs are compared as longs, and only a double on either side
+    brings the comparison into doubles. Big integers are ordered by
+    lnum_cmp.
+*/
+int lnum_lt(lval* x, lval* y) {
+    switch (LNUM_PAIR(x, y)) {
+        case LNUM_LL: return x->data.num < y->data.num;
+        case LNUM_LD: return x->data.num < y->data.dec;
+        case LNUM_DL: return x->data.dec < y->data.num;
+        case LNUM_DD: return x->data.dec < y->data.dec;
+        default: return lnum_cmp(x, y) < 0;
+    }
 }
 
-lval* builtin_lt(lenv* e, lval* a) {
-    return builtin_ord(e, a, "<");
+int lnum_gt(lval* x, lval* y) {
+    switch (LNUM_PAIR(x, y)) {
+        case LNUM_LL: return x->data.num > y->data.num;
+        case LNUM_LD: return x->data.num > y->data.dec;
+        case LNUM_DL: return x->data.dec > y->data.num;
+        case LNUM_DD: return x->data.dec > y->data.dec;
+        default: return lnum_cmp(x, y) > 0;
+    }
 }
 
-lval* builtin_ge(lenv* e, lval* a) {
-    return builtin_ord(e, a, ">=");
+int lnum_le(lval* x, lval* y) {
+    switch (LNUM_PAIR(x, y)) {
+        case LNUM_LL: return x->data.num <= y->data.num;
+        case LNUM_LD: return x->data.num <= y->data.dec;
+        case LNUM_DL: return x->data.dec <= y->data.num;
+        case LNUM_DD: return x->data.dec <= y->data.dec;
+        default: return lnum_cmp(x, y) <= 0;
+    }
 }
 
-lval* builtin_le(lenv* e, lval* a) {
-    return builtin_ord(e, a, "<=");
+int lnum_ge(lval* x, lval* y) {
+    switch (LNUM_PAIR(x, y)) {
+        case LNUM_LL: return x->data.num >= y->data.num;
+        case LNUM_LD: return x->data.num >= y->data.dec;
+        case LNUM_DL: return x->data.dec >= y->data.num;
+        case LNUM_DD: return x->data.dec >= y->data.dec;
+        default: return lnum_cmp(x, y) >= 0;
+    }
 }
 
-lval* builtin_ord(lenv* e, lval* a, char* op) {
-    LASSERT_NUM(op, a, 2);
-    LASSERT(a, 
-        a->cell[0]->type == LVAL_LONG || a->cell[0]->type == LVAL_DOUBLE,
-        "Function '%s' passed incorrect type for argument %i. " \
-    "Got %s, Expected %s.", op, 0, ltype_name(a->cell[0]->type), "LONG or DOUBLE")
-    LASSERT(a, 
-        a->cell[1]->type == LVAL_LONG || a->cell[0]->type == LVAL_DOUBLE,
-        "Function '%s' passed incorrect type for argument %i. " \
-    "Got %s, Expected %s.", op, 1, ltype_name(a->cell[0]->type), "LONG or DOUBLE")
-
-    int r;
-    double xVal = (a->cell[0]->type == LVAL_LONG)? a->cell[0]->data.num : a->cell[0]->data.dec;  
-    double yVal = (a->cell[1]->type == LVAL_LONG)? a->cell[1]->data.num : a->cell[1]->data.dec;
-    if (strcmp(op, ">") == 0) {
-        r = (xVal > yVal);
-    }
-    if (strcmp(op, "<") == 0) {
-        r = (xVal < yVal);
-    }
-    if (strcmp(op, ">=") == 0) {
-        r = (xVal >= yVal);
-    }
-    if (strcmp(op, "<=") == 0) {
-        r = (xVal <= yVal);
+static lval* builtin_ord(int argc, lval** argv, char* op, lnum_test k) {
+    LASSERT_NUM_V(op, argc, argv, 2);
+    for (int i = 0; i < 2; i++) {
+        LASSERT_V(argc, argv, lnum_is(argv[i]),
+            "Function '%s' passed incorrect type for argument %i. " \
+        "Got %s, Expected %s.", op, i, ltype_name(argv[i]->type), "LONG or DOUBLE")
     }
 
-    lval_del(a);
+    int r = k(argv[0], argv[1]);
+    lval_del_args(argc, argv);
     return lval_long(r);
 }
 
+lval* builtin_gt_v(lenv* e, int argc, lval** argv) {
+    return builtin_ord(argc, argv, ">", lnum_gt);
+}
+
+lval* builtin_lt_v(lenv* e, int argc, lval** argv) {
+    return builtin_ord(argc, argv, "<", lnum_lt);
+}
+
+lval* builtin_ge_v(lenv* e, int argc, lval** argv) {
+    return builtin_ord(argc, argv, ">=", lnum_ge);
+}
+
+lval* builtin_le_v(lenv* e, int argc, lval** argv) {
+    return builtin_ord(argc, argv, "<=", lnum_le);
+}
+
+lval* builtin_gt(lenv* e, lval* a) { return lval_call_vector(e, builtin_gt_v, a); }
+lval* builtin_lt(lenv* e, lval* a) { return lval_call_vector(e, builtin_lt_v, a); }
+lval* builtin_ge(lenv* e, lval* a) { return lval_call_vector(e, builtin_ge_v, a); }
+lval* builtin_le(lenv* e, lval* a) { return lval_call_vector(e, builtin_le_v, a); }
+
+// Whether two lambdas take the same formals, past any already bound
+static int lval_eq_params(lval* x, lval* y) {
+    lfun* f = x->fun;
+    lfun* g = y->fun;
+    lval* xs = f->params->syms;
+    lval* ys = g->params->syms;
+    if (xs->count - f->bound != ys->count - g->bound) { return 0; }
+    for (int i = 0; i < xs->count - f->bound; i++) {
+        if (!lval_eq(xs->cell[f->bound + i], ys->cell[g->bound + i])) { return 0; }
+    }
+    return 1;
+}
+
 int lval_eq(lval* x, lval* y) {
     // Different types are always unequal
     if (x->type != y->type) { return 0; }
 
+    // Equal values shared by hash-consing are mostly the same node,
+    // and differing hashes tell them apart without looking inside
+    if (x->refs && y->refs) {
+        if (x == y) { return 1; }
+        if (lval_hash(x) != lval_hash(y)) { return 0; }
+    }
+
     // Compare base on type
     switch (x->type) {
         // Compare numerical types
         case LVAL_LONG: return (x->data.num == y->data.num);
         case LVAL_DOUBLE: return (x->data.dec == y->data.dec);
+        case LVAL_BIGINT: return lbig_cmp(x->data.big, y->data.big) == 0;
+
+        // Delays are equal when they are the same one, or once both
+        // are forced to equal values
+        case LVAL_THUNK:
+            if (x->data.thunk == y->data.thunk) { return 1; }
+            return x->data.thunk->value && y->data.thunk->value &&
+                lval_eq(x->data.thunk->value, y->data.thunk->value);
 
         // Compare string values
         case LVAL_ERR: return (strcmp(x->data.err, y->data.err) == 0);
@@ -67,11 +133,11 @@ int lval_eq(lval* x, lval* y) {
 
         // If builtin compare, otherwise compare formals and body
         case LVAL_FUN:
-            if (x->builtin || y->builtin) {
-                return x->builtin == y->builtin;
+            if (x->fun->builtin || y->fun->builtin) {
+                return x->fun->builtin == y->fun->builtin;
             } else {
-                return lval_eq(x->formals, y->formals) &&
-                    lval_eq(x->body, y->body);
+                return lval_eq_params(x, y) &&
+                    lval_eq(lval_body(x), lval_body(y));
             }
         
         case LVAL_QEXPR:
@@ -89,63 +155,121 @@ int lval_eq(lval* x, lval* y) {
     return 0;
 }
 
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-    LASSERT_NUM(op, a, 2);
-    int r;
-    if (strcmp(op, "==") == 0) {
-        r =  lval_eq(a->cell[0], a->cell[1]);
-    }
-    if (strcmp(op, "!=") == 0) {
-        r = !lval_eq(a->cell[0], a->cell[1]);
-    }
-    if (strcmp(op, "or") == 0) {
-        LASSERT_TYPE("or", a, 0, LVAL_LONG)
-        LASSERT_TYPE("or", a, 1, LVAL_LONG)
-        r = (a->cell[0]->data.num || a->cell[1]->data.num);
-    }
-    if (strcmp(op, "and") == 0) {
-        LASSERT_TYPE("and", a, 0, LVAL_LONG)
-        LASSERT_TYPE("and", a, 1, LVAL_LONG)
-        r = (a->cell[0]->data.num && a->cell[1]->data.num);
+lval* builtin_eq_v(lenv* e, int argc, lval** argv) {
+    LASSERT_NUM_V("==", argc, argv, 2);
+    int r = lval_eq(argv[0], argv[1]);
+    lval_del_args(argc, argv);
+    return lval_long(r);
+}
+
+lval* builtin_ne_v(lenv* e, int argc, lval** argv) {
+    LASSERT_NUM_V("!=", argc, argv, 2);
+    int r = !lval_eq(argv[0], argv[1]);
+    lval_del_args(argc, argv);
+    return lval_long(r);
+}
+
+lval* builtin_eq(lenv* e, lval* a) { return lval_call_vector(e, builtin_eq_v, a); }
+lval* builtin_ne(lenv* e, lval* a) { return lval_call_vector(e, builtin_ne_v, a); }
+
+/*
+    Logical forms
+    'and' and 'or' take any number of longs. A call to either by name
+    evaluates its arguments from the left only until one decides the
+    result, which is 0 or 1. Passed around as values they are builtins
+    like any other, given values already there.
+*/
+lval* lval_logic_step(lbuiltin op, lval* v, int i) {
+    if (v->type == LVAL_ERR) { return v; }
+    if (v->type != LVAL_LONG) {
+        lval* err = lval_err(
+            "Function '%s' passed incorrect type for argument %i. "
+            "Got %s, Expected %s.",
+            op == builtin_and ? "and" : "or", i, ltype_name(v->type), ltype_name(LVAL_LONG));
+        lval_del(v);
+        return err;
     }
+    int decides = op == builtin_and ? v->data.num == 0 : v->data.num != 0;
+    lval_del(v);
+    return decides ? lval_long(op == builtin_or) : NULL;
+}
 
+// The same steps over arguments that have all been evaluated
+static lval* builtin_logic(lbuiltin op, lval* a) {
+    lval* r = NULL;
+    for (int i = 0; r == NULL && a->count; i++) { r = lval_logic_step(op, lval_pop(a, 0), i); }
     lval_del(a);
-    return lval_long(r);
+    return r ? r : lval_long(op == builtin_and);
 }
 
-lval* builtin_eq(lenv* e, lval* a) {
-    return builtin_cmp(e, a, "==");
+lval* builtin_or(lenv* e, lval* a) { return builtin_logic(builtin_or, a); }
+lval* builtin_and(lenv* e, lval* a) { return builtin_logic(builtin_and, a); }
+
+lval* builtin_if_v(lenv* e, int argc, lval** argv) {
+    LASSERT_NUM_V("if", argc, argv, 3)
+    LASSERT_TYPE_V("if", argc, argv, 0, LVAL_LONG)
+    LASSERT_TYPE_V("if", argc, argv, 1, LVAL_QEXPR)
+    LASSERT_TYPE_V("if", argc, argv, 2, LVAL_QEXPR)
+
+    // Take the chosen expression and delete the others
+    int i = argv[0]->data.num ? 1 : 2;
+    lval* x = argv[i];
+    lval_del(argv[0]);
+    lval_del(argv[3 - i]);
+
+    // Mark it as evaluable and evaluate it
+    lval_retype(x, LVAL_SEXPR);
+    return lval_eval(e, x);
 }
 
-lval* builtin_ne(lenv* e, lval* a) {
-    return builtin_cmp(e, a, "!=");
+lval* builtin_if(lenv* e, lval* a) {
+    return lval_call_vector(e, builtin_if_v, a);
 }
-lval* builtin_or(lenv* e, lval* a) {
-    return builtin_cmp(e, a, "or");
+
+/*
+    (cond {test body} ...) tries the tests in order and evaluates the
+    body of the first that is not 0, in tail position like a branch of
+    'if'. With none, the result is the empty expression.
+*/
+int lval_cond_form(lval* x) {
+    for (int i = 1; i < x->count; i++) {
+        if (x->cell[i]->type != LVAL_QEXPR || x->cell[i]->count != 2) { return 0; }
+    }
+    return 1;
 }
 
-lval* builtin_and(lenv* e, lval* a) {
-    return builtin_cmp(e, a, "and");
+lval* lval_cond_test(lval* v, int i) {
+    if (v->type == LVAL_LONG || v->type == LVAL_ERR) { return v; }
+    lval* err = lval_err(
+        "Function 'cond' passed incorrect type for the test of clause %i. "
+        "Got %s, Expected %s.",
+        i, ltype_name(v->type), ltype_name(LVAL_LONG));
+    lval_del(v);
+    return err;
 }
 
-lval* builtin_if(lenv* e, lval* a) {
-    LASSERT_NUM("if", a, 3)
-    LASSERT_TYPE("if", a, 0, LVAL_LONG)
-    LASSERT_TYPE("if", a, 1, LVAL_QEXPR)
-    LASSERT_TYPE("if", a, 2, LVAL_QEXPR)
-
-    // Mark both expressions as evaluable
-    lval* x;
-    a->cell[1]->type = LVAL_SEXPR;
-    a->cell[2]->type = LVAL_SEXPR;
-
-    if (a->cell[0]->data.num) {
-        x = lval_eval(e, lval_pop(a, 1));
-    } else {
-        x = lval_eval(e, lval_pop(a, 2));
+lval* builtin_cond(lenv* e, lval* a) {
+    int tail = ltail.pos;
+    ltail.pos = 0;
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_TYPE("cond", a, i, LVAL_QEXPR)
+        LASSERT(a, a->cell[i]->count == 2,
+            "Function 'cond' passed a clause of %i elements for argument %i. "
+            "Expected %i.", a->cell[i]->count, i, 2)
     }
 
-    // Delete the argument list and return
+    for (int i = 0; i < a->count; i++) {
+        lval* x = lval_cond_test(lval_eval(e, lval_pop(a->cell[i], 0)), i);
+        if (x->type == LVAL_ERR) { lval_del(a); return x; }
+        int taken = x->data.num != 0;
+        lval_del(x);
+        if (taken) {
+            lval* body = lval_pop(a->cell[i], 0);
+            lval_del(a);
+            ltail.pos = tail;
+            return lval_eval(e, body);
+        }
+    }
     lval_del(a);
-    return x;
+    return lval_sexpr();
 }
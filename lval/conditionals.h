@@ -7,16 +7,38 @@ lval* builtin_gt(lenv* e, lval* a);
 lval* builtin_lt(lenv* e, lval* a);
 lval* builtin_ge(lenv* e, lval* a);
 lval* builtin_le(lenv* e, lval* a);
+lval* builtin_gt_v(lenv* e, int argc, lval** argv);
+lval* builtin_lt_v(lenv* e, int argc, lval** argv);
+lval* builtin_ge_v(lenv* e, int argc, lval** argv);
+lval* builtin_le_v(lenv* e, int argc, lval** argv);
 
-lval* builtin_ord(lenv* e, lval* a, char* op);
+// Comparisons of two numbers
+typedef int (*lnum_test)(lval* x, lval* y);
+int lnum_lt(lval* x, lval* y);
+int lnum_gt(lval* x, lval* y);
+int lnum_le(lval* x, lval* y);
+int lnum_ge(lval* x, lval* y);
 
 int lval_eq(lval* x, lval* y);
-lval* builtin_cmp(lenv* e, lval* a, char* op);
 lval* builtin_eq(lenv* e, lval* a);
 lval* builtin_ne(lenv* e, lval* a);
+lval* builtin_eq_v(lenv* e, int argc, lval** argv);
+lval* builtin_ne_v(lenv* e, int argc, lval** argv);
 
 lval* builtin_if(lenv* e, lval* a);
+lval* builtin_if_v(lenv* e, int argc, lval** argv);
 lval* builtin_and(lenv* e, lval* a);
 lval* builtin_or(lenv* e, lval* a);
 
+// Takes v, the value of argument i of a short circuit call to op: the
+// result of the call when v decides it, otherwise NULL
+lval* lval_logic_step(lbuiltin op, lval* v, int i);
+
+// Whether the arguments of the call x are all clauses of 'cond'
+int lval_cond_form(lval* x);
+// Takes v, the value of the test of clause i: v when it is a number or
+// an error, otherwise the error for it
+lval* lval_cond_test(lval* v, int i);
+lval* builtin_cond(lenv* e, lval* a);
+
 #endif
@@ -1,178 +1,747 @@
 #include "environment.h"
 #include <stdlib.h>
+#include <string.h>
 #include "error.h"
 #include "expressions.h"
 #include "operations.h"
 #include "conditionals.h"
+#include "memory.h"
+#include "vm.h"
+#include "fold.h"
+#include "jit.h"
+#include "hashcons.h"
+#include "memo.h"
+#include "lazy.h"
+#include "loop.h"
+#include "macro.h"
+
+// Environments up to this size are searched linearly
+#define LENV_LINEAR 8
+
+unsigned long lenv_hash(char* sym) {
+    // 64-bit FNV-1a
+    unsigned long h = 14695981039346656037UL;
+    for (; *sym; sym++) {
+        h ^= (unsigned char) *sym;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/*
+    Frames may shadow global bindings, so a cached global cell is only
+    trusted for names no frame binds. Frame bindings are counted per
+    hash bucket here, which keeps that check a single load. The counts
+    cover the frames of every session, which never run side by side.
+*/
+#define LENV_SHADOWS 4096
+static int lenv_shadows[LENV_SHADOWS];
+
+static int lenv_find(lenv* e, char* sym, unsigned long hash);
+
+// Session layers shadow too, where they redefine a name of their base
+static int lenv_shadowing(lenv* e, int i) {
+    if (e->frame) { return 1; }
+    for (lenv* p = e->par; p; p = p->par) {
+        if (lenv_find(p, e->syms[i], e->hashes[i]) != -1) { return 1; }
+    }
+    return 0;
+}
+
+static void lenv_shadow(lenv* e, int i, int n) {
+    if (lenv_shadowing(e, i)) { lenv_shadows[e->hashes[i] & (LENV_SHADOWS - 1)] += n; }
+}
+
+static lcell* lcell_new(lval* v) {
+    lcell* c = (lcell*) lmem_xalloc(LMEM_ENV, sizeof(lcell));
+    c->val = v;
+    return c;
+}
+
+/*
+    Call frames are carved out of one contiguous region, each with a slot
+    for every formal: its name, its cell and the hash of its name. When
+    the region is full frames fall back to the heap. There is one region
+    for the process, used by whichever session runs.
+*/
+#define LENV_STACK_SIZE (256 * 1024)
+#define LENV_SLOT_SIZE (sizeof(char*) + sizeof(lcell*) + sizeof(unsigned long) + sizeof(lcell))
+static char* lenv_stack = NULL;
+static long lenv_stack_top = 0;
+
+// Headers of frames popped, kept for reuse up to a point
+#define LENV_FREE_FRAMES 256
+static lenv* lenv_free_frames = NULL;
+static int lenv_nfree = 0;
 
 lenv* lenv_new(void) {
-    lenv* e = (lenv*) malloc(sizeof(lenv));
+    lenv* e = (lenv*) lmem_xalloc(LMEM_ENV, sizeof(lenv));
+    lmem.live[LMEM_ENV]++;
     e->par = NULL;
+    e->frame = 0;
+    e->refs = 1;
+    e->partial = 0;
+    e->bound = 0;
+    e->loop = 0;
+    e->owner = 0;
+    e->extended = 0;
+    e->frozen = 0;
+    e->session = NULL;
+    e->budget = 0;
+    e->stack = 0;
+    e->base = -1;
     e->count = 0;
+    e->capacity = 0;
     e->syms = NULL;
-    e->vals = NULL;
+    e->cells = NULL;
+    e->hashes = NULL;
+    e->index = NULL;
+    e->index_size = 0;
     return e;
 }
 
 void lenv_del(lenv* e) {
+    // Frames go once the last closure over them does
+    if (e->frame && --e->refs > 0) { return; }
+    if (e->frame) { lenv_release(e->par); }
+
     for (int i = 0; i < e->count; i++) {
-        free(e->syms[i]);
-        lval_del(e->vals[i]);
+        lenv_shadow(e, i, -1);
+        lval_del(e->cells[i]->val);
+        if (!e->stack) {
+            lmem_free(e->syms[i]);
+            lmem_free(e->cells[i]);
+        }
+    }
+    if (!e->stack) {
+        lmem_free(e->syms);
+        lmem_free(e->cells);
+        lmem_free(e->hashes);
+    }
+    lmem_free(e->index);
+    lmem.live[LMEM_ENV]--;
+
+    // Frame headers are kept for reuse, as many as a burst of calls
+    // usually needs rather than as many as the deepest one did
+    if (e->frame && lenv_nfree < LENV_FREE_FRAMES) {
+        e->par = lenv_free_frames;
+        lenv_free_frames = e;
+        lenv_nfree++;
+    } else {
+        lmem_free(e);
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
 }
 
 lenv* lenv_copy(lenv* e) {
-    lenv* n = (lenv*) malloc(sizeof(lenv));
-    n->par = e->par;
+    lenv* n = (lenv*) lmem_xalloc(LMEM_ENV, sizeof(lenv));
+    lmem.live[LMEM_ENV]++;
+    n->par = lenv_retain(e->par);
+    n->frame = e->frame;
+    n->refs = 1;
+    n->partial = e->partial;
+    n->bound = e->bound;
+    n->loop = e->loop;
+    n->owner = e->owner;
+    n->extended = e->extended;
+    n->frozen = 0;
+    n->session = e->session == e ? n : e->session;
+    n->budget = e->budget;
+    n->stack = 0;
+    n->base = -1;
     n->count = e->count;
-    n->syms = (char**) malloc(sizeof(char*) * n->count);
-    n->vals = (lval**) malloc(sizeof(lval*) * n->count);
+    n->capacity = e->count;
+    n->syms = (char**) lmem_xalloc(LMEM_ENV, sizeof(char*) * n->count);
+    n->cells = (lcell**) lmem_xalloc(LMEM_ENV, sizeof(lcell*) * n->count);
+    n->hashes = (unsigned long*) lmem_xalloc(LMEM_ENV, sizeof(unsigned long) * n->count);
     for (int i = 0; i < e->count; i++) {
-        n->syms[i] = (char*) malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
-        n->vals[i] = lval_copy(e->vals[i]);
+        n->syms[i] = lmem_strdup(LMEM_ENV, e->syms[i]);
+        n->cells[i] = lcell_new(lval_copy(e->cells[i]->val));
+        n->hashes[i] = e->hashes[i];
+        lenv_shadow(n, i, 1);
+    }
+
+    // The index only holds positions so it can be copied as is
+    n->index_size = e->index_size;
+    n->index = NULL;
+    if (e->index) {
+        n->index = (int*) lmem_xalloc(LMEM_ENV, sizeof(int) * n->index_size);
+        memcpy(n->index, e->index, sizeof(int) * n->index_size);
     }
     return n;
 }
 
-lval* lenv_get(lenv* e, lval* k) {
-    // Iterate over all items in environment
+lenv* lenv_retain(lenv* e) {
+    if (e && e->frame) { e->refs++; }
+    return e;
+}
+
+void lenv_release(lenv* e) {
+    if (e && e->frame) { lenv_del(e); }
+}
+
+// Add a new binding, borrowing the name while the frame is on the stack
+static void lenv_append(lenv* e, char* sym, unsigned long hash, lval* v);
+
+lenv* lenv_frame(lenv* e, int formals) {
+    lenv* f = lenv_free_frames;
+    if (f) {
+        lenv_free_frames = f->par;
+        lenv_nfree--;
+        lmem.live[LMEM_ENV]++;
+    } else {
+        f = lenv_new();
+    }
+    f->frame = 1;
+    f->refs = 1;
+    f->partial = 0;
+    f->bound = 0;
+    f->loop = 0;
+    f->owner = 0;
+    f->extended = 0;
+    f->frozen = 0;
+    f->session = e ? e->session : NULL;
+    f->budget = 0;
+    f->stack = 0;
+    f->base = -1;
+    f->count = 0;
+    f->capacity = 0;
+    f->syms = NULL;
+    f->cells = NULL;
+    f->hashes = NULL;
+    f->index = NULL;
+    f->index_size = 0;
+
+    // Arguments bound by a partial application stay in its frame, the
+    // parent of this one, and come first
+    if (e && e->partial) { f->bound = e->bound + e->count; }
+    int slots = formals;
+    f->par = lenv_retain(e);
+
+    if (lenv_stack == NULL) { lenv_stack = malloc(LENV_STACK_SIZE); }
+    long size = slots * LENV_SLOT_SIZE;
+    if (slots > 0 && lenv_stack && lenv_stack_top + size <= LENV_STACK_SIZE) {
+        char* p = lenv_stack + lenv_stack_top;
+        f->syms = (char**) p;
+        f->cells = (lcell**) (p + slots * sizeof(char*));
+        f->hashes = (unsigned long*) (p + slots * (sizeof(char*) + sizeof(lcell*)));
+        lcell* cells = (lcell*) (p + slots * (sizeof(char*) + sizeof(lcell*) + sizeof(unsigned long)));
+        for (int i = 0; i < slots; i++) { f->cells[i] = &cells[i]; }
+
+        f->stack = 1;
+        f->base = lenv_stack_top;
+        f->capacity = slots;
+        lenv_stack_top += size;
+    }
+    return f;
+}
+
+// Give a frame bindings of its own on the heap
+static void lenv_unstack(lenv* e) {
+    char** syms = lmem_xrealloc(LMEM_ENV, NULL, sizeof(char*) * e->count);
+    lcell** cells = lmem_xrealloc(LMEM_ENV, NULL, sizeof(lcell*) * e->count);
+    unsigned long* hashes = lmem_xrealloc(LMEM_ENV, NULL, sizeof(unsigned long) * e->count);
     for (int i = 0; i < e->count; i++) {
-        // Check if the stored string matches the symbol string
-        // If it does, return a copy of hte value
-        if (strcmp(e->syms[i], k->data.sym) == 0) {
-            return lval_copy(e->vals[i]);
+        syms[i] = lmem_strdup(LMEM_ENV, e->syms[i]);
+        cells[i] = lcell_new(e->cells[i]->val);
+        hashes[i] = e->hashes[i];
+    }
+    e->syms = syms;
+    e->cells = cells;
+    e->hashes = hashes;
+    e->capacity = e->count;
+    e->stack = 0;
+}
+
+void lenv_pop(lenv* e) {
+    long base = e->base;
+    e->base = -1;
+
+    // Anything still holding on to the frame needs it off the stack
+    if (e->stack && e->refs > 1) { lenv_unstack(e); }
+    lenv_del(e);
+
+    // Frames are popped in the order they were pushed
+    if (base >= 0) { lenv_stack_top = base; }
+}
+
+long lenv_stack_usage(void) { return lenv_stack_top; }
+
+// Position of a symbol in this environment only, -1 if unbound
+static int lenv_find(lenv* e, char* sym, unsigned long hash) {
+    if (e->index == NULL) {
+        for (int i = 0; i < e->count; i++) {
+            if (e->hashes[i] == hash && strcmp(e->syms[i], sym) == 0) { return i; }
         }
+        return -1;
     }
 
-    // If no symbol found so far, check in parent
-    if (e->par) {
-        return lenv_get(e->par, k);
+    // Linear probing, the table is never more than half full
+    unsigned long mask = e->index_size - 1;
+    for (unsigned long j = hash & mask; e->index[j] != -1; j = (j + 1) & mask) {
+        int i = e->index[j];
+        if (e->hashes[i] == hash && strcmp(e->syms[i], sym) == 0) { return i; }
     }
+    return -1;
+}
+
+static void lenv_index_insert(lenv* e, int i) {
+    unsigned long mask = e->index_size - 1;
+    unsigned long j = e->hashes[i] & mask;
+    while (e->index[j] != -1) { j = (j + 1) & mask; }
+    e->index[j] = i;
+}
+
+// Rebuild the index so that it stays at most half full
+static void lenv_reindex(lenv* e) {
+    if (e->count <= LENV_LINEAR || e->count * 2 <= e->index_size) { return; }
+
+    int size = e->index_size ? e->index_size : 2 * LENV_LINEAR;
+    while (size < e->count * 2) { size *= 2; }
+
+    lmem_free(e->index);
+    e->index = (int*) lmem_xalloc(LMEM_ENV, sizeof(int) * size);
+    e->index_size = size;
+    for (int j = 0; j < size; j++) { e->index[j] = -1; }
+    for (int i = 0; i < e->count; i++) { lenv_index_insert(e, i); }
+}
+
+// The frame enclosing frame e where its lambda was defined, past the
+// frames of partial applications
+static lenv* lenv_up(lenv* e) {
+    do { e = e->par; } while (e && e->partial);
+    return e;
+}
+
+// Lexical address of a symbol in frame e, -1 if unbound there
+static int lenv_find_slot(lenv* e, lval* k) {
+    for (; e; e = e->par) {
+        int i = lenv_find(e, k->data.sym, k->hash);
+        if (i != -1) { return i + e->bound; }
+        if (e->bound == 0) { break; }
+    }
+    return -1;
+}
+
+lval* lenv_lookup(lenv* e, lval* k) {
+    if (k->depth >= 0) {
+        // Loops in the body run it in frames of their own variables
+        lenv* f = e;
+        while (f && f->loop) {
+            int i = lenv_find(f, k->data.sym, k->hash);
+            if (i != -1) { return f->cells[i]->val; }
+            f = f->par;
+        }
+
+        // In a call of the lambda the symbol was resolved for, the frames
+        // up from it are those it was resolved against
+        if (f && f->owner == k->owner) {
+            // Frames '=' has added to on the way may hide the binding
+            int d = k->depth;
+            while (d > 0 && !f->extended) { f = lenv_up(f); d--; }
+            // Formals bound by partial application are in the frames above
+            while (d == 0 && k->slot < f->bound && !f->extended) { f = f->par; }
+            if (d == 0 && k->slot >= f->bound) { return f->cells[k->slot - f->bound]->val; }
+        }
+    } else if (k->cache && lenv_shadows[k->hash & (LENV_SHADOWS - 1)] == 0) {
+        // Cached global cells hold as long as no frame binds the name
+        return k->cache->val;
+    }
+    if (k->depth == LENV_GLOBAL) { while (e && e->frame) { e = e->par; } }
+
+    // Otherwise walk up the parents until the symbol is found
+    for (; e; e = e->par) {
+        int i = lenv_find(e, k->data.sym, k->hash);
+        if (i != -1) {
+            // Remember where global values live
+            if (!e->frame && k->depth < 0) { k->cache = e->cells[i]; }
+            return e->cells[i]->val;
+        }
+    }
+    return NULL;
+}
+
+lval* lenv_get(lenv* e, lval* k) {
+    // If found, return a copy of the value
+    lval* v = lenv_lookup(e, k);
+    if (v) { return lval_copy(v); }
 
     // If no symbol found and no parent, return error
     return lval_err("Unbounded symbol %s", k->data.sym);
 }
 
 void lenv_put(lenv* e, lval* k, lval* v) {
-    // Iterate over all items in the environment
-    // This is to see if the variables already exist
-    for (int i = 0; i < e->count; i++) {
-        // If a variable is found, delete the item at that position
-        // Then replace it with the data provided by the user
-        if (strcmp(e->syms[i], k->data.sym) == 0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
-        }
+    // Bound values are only ever copied out, so they may share nodes
+    // A copy refused by the heap budget leaves the binding as it was
+    lval* x = lval_copy(v);
+    if (x->type == LVAL_ERR && lmem_exhausted()) { lval_del(x); return; }
+    lenv_bind(e, k, lhcons_enabled ? lval_intern(x) : x);
+}
+
+// Bind k, replacing its value in its cell if it exists
+static void lenv_set(lenv* e, int i, lval* k, lval* v) {
+    if (i != -1) {
+        lval_del(e->cells[i]->val);
+        e->cells[i]->val = v;
+        return;
+    }
+
+    // The symbol may not outlive the binding, so leave the stack first
+    if (e->stack) { lenv_unstack(e); }
+    lenv_append(e, k->data.sym, k->hash, v);
+}
+
+void lenv_bind(lenv* e, lval* k, lval* v) {
+    int i = lenv_find(e, k->data.sym, k->hash);
+    if (i == -1 && e->frame) { e->extended = 1; }
+    lenv_set(e, i, k, v);
+}
+
+void lenv_bind_formal(lenv* e, lval* k, lval* v) {
+    // Formals live as long as the call, so their names can be borrowed
+    int i = lenv_find(e, k->data.sym, k->hash);
+    if (i == -1 && e->stack && e->count < e->capacity) {
+        lenv_append(e, k->data.sym, k->hash, v);
+    } else {
+        lenv_set(e, i, k, v);
     }
+}
+
+static void lenv_append(lenv* e, char* sym, unsigned long hash, lval* v) {
+    int i;
+    if (e->stack) {
+        i = e->count++;
+        e->cells[i]->val = v;
+        e->syms[i] = sym;
+        e->hashes[i] = hash;
+        lenv_shadow(e, i, 1);
+        return;
+    }
+
+    // Make room for a new entry
+    if (e->count == e->capacity) {
+        e->capacity = e->capacity ? e->capacity * 2 : 4;
+        e->cells = lmem_xrealloc(LMEM_ENV, e->cells, sizeof(lcell*) * e->capacity);
+        e->syms = lmem_xrealloc(LMEM_ENV, e->syms, sizeof(char*) * e->capacity);
+        e->hashes = lmem_xrealloc(LMEM_ENV, e->hashes, sizeof(unsigned long) * e->capacity);
+    }
+
+    // Store the value and a copy of the symbol string
+    i = e->count++;
+    e->cells[i] = lcell_new(v);
+    e->syms[i] = lmem_strdup(LMEM_ENV, sym);
+    e->hashes[i] = hash;
+    lenv_shadow(e, i, 1);
+
+    if (e->index && e->count * 2 <= e->index_size) {
+        lenv_index_insert(e, i);
+    } else {
+        lenv_reindex(e);
+    }
+}
 
-    // If no existing entry is found, allocate space for new entry
-    e->count++;
-    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
+void lenv_freeze(lenv* base) {
+    base->frozen = 1;
+}
 
-    // Copy contents of lval and symbol string
-    e->vals[e->count - 1] = lval_copy(v);
-    e->syms[e->count - 1] = (char*) malloc(strlen(k->data.sym) + 1);
-    strcpy(e->syms[e->count - 1], k->data.sym);
+lenv* lenv_session(lenv* base) {
+    lenv* e = lenv_new();
+    e->par = base;
+    e->session = e;
+    e->budget = lmem_budget_new();
+    return e;
 }
 
 void lenv_def(lenv* e, lval* k, lval* v) {
-    // Iterate until e has no parent
-    while (e->par) { e = e->par; }
+    // Definitions go to the session running the code, even from
+    // functions of the base it is layered on
+    if (e->session) {
+        e = e->session;
+    } else {
+        // Iterate until e has no parent
+        while (e->par) { e = e->par; }
+    }
 
     // Put the value in e
+    lfold_rebind(e, k);
     lenv_put(e, k, v);
 }
 
+// A function value with nothing set yet
+static lval* lval_fun(void) {
+    lval* v = lval_alloc(LVAL_FUN);
+    v->fun = (lfun*) lmem_xalloc(LVAL_FUN, sizeof(lfun));
+    memset(v->fun, 0, sizeof(lfun));
+    v->fun->refs = 1;
+    return v;
+}
+
+lfun* lfun_retain(lfun* f) {
+    f->refs++;
+    return f;
+}
+
+void lfun_release(lfun* f) {
+    if (--f->refs > 0) { return; }
+    lenv_release(f->env);
+    lparams_release(f->params);
+    lvm_release(f->code);
+    lmemo_release(f->memo);
+    lmem_free(f);
+}
+
+lfun* lfun_copy(lfun* f) {
+    lfun* x = (lfun*) lmem_xalloc(LVAL_FUN, sizeof(lfun));
+    *x = *f;
+    x->refs = 1;
+    lenv_retain(x->env);
+    lparams_retain(x->params);
+    lvm_retain(x->code);
+    lmemo_retain(x->memo);
+    return x;
+}
+
 lval* lval_builtin(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
-  v->builtin = func;
+  lval* v = lval_fun();
+  v->fun->builtin = func;
   return v;
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+// Builtins with a vector entry point may be given it as vfunc
+void lenv_add_vector_builtin(lenv* e, char* name, lbuiltin func, lbuiltin_v vfunc, int pure) {
     lval* k = lval_sym(name);
     lval* v = lval_builtin(func);
+    v->fun->vbuiltin = vfunc;
+    v->fun->pure = pure;
     lenv_put(e, k, v);
     lval_del(k); lval_del(v);
 }
 
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+    lenv_add_vector_builtin(e, name, func, NULL, 0);
+}
+
+// Builtins whose result depends only on their arguments
+void lenv_add_pure_builtin(lenv* e, char* name, lbuiltin func) {
+    lenv_add_vector_builtin(e, name, func, NULL, 1);
+}
+
 void lenv_add_builtins(lenv* e) {
     // List functions
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
+    lenv_add_pure_builtin(e, "list", builtin_list);
+    lenv_add_vector_builtin(e, "head", builtin_head, builtin_head_v, 1);
+    lenv_add_vector_builtin(e, "tail", builtin_tail, builtin_tail_v, 1);
     lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "join", builtin_join);
-    lenv_add_builtin(e, "len", builtin_len);
-    lenv_add_builtin(e, "cons", builtin_cons);
+    lenv_add_pure_builtin(e, "join", builtin_join);
+    lenv_add_vector_builtin(e, "len", builtin_len, builtin_len_v, 1);
+    lenv_add_pure_builtin(e, "cons", builtin_cons);
+
+    // Delayed values and lazy sequences
+    lenv_add_builtin(e, "delay", builtin_delay);
+    lenv_add_builtin(e, "force", builtin_force);
+    lenv_add_builtin(e, "lazy-cons", builtin_lazy_cons);
+    lenv_add_pure_builtin(e, "lazy-head", builtin_lazy_head);
+    lenv_add_builtin(e, "lazy-tail", builtin_lazy_tail);
+    lenv_add_builtin(e, "take", builtin_take);
 
     // Mathematical Functions
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
-    lenv_add_builtin(e, "^", builtin_pow);
-    lenv_add_builtin(e, "%", builtin_mod);
-    lenv_add_builtin(e, "min", builtin_min);
-    lenv_add_builtin(e, "max", builtin_max);
+    lenv_add_vector_builtin(e, "+", builtin_add, builtin_add_v, 1);
+    lenv_add_vector_builtin(e, "-", builtin_sub, builtin_sub_v, 1);
+    lenv_add_vector_builtin(e, "*", builtin_mul, builtin_mul_v, 1);
+    lenv_add_vector_builtin(e, "/", builtin_div, builtin_div_v, 1);
+    lenv_add_vector_builtin(e, "^", builtin_pow, builtin_pow_v, 1);
+    lenv_add_vector_builtin(e, "%", builtin_mod, builtin_mod_v, 1);
+    lenv_add_vector_builtin(e, "min", builtin_min, builtin_min_v, 1);
+    lenv_add_vector_builtin(e, "max", builtin_max, builtin_max_v, 1);
     
     lenv_add_builtin(e, "def", builtin_def);
     lenv_add_builtin(e, "=", builtin_put);
     lenv_add_builtin(e, "ls", builtin_ls);
     lenv_add_builtin(e, "\\", builtin_lambda);
+    lenv_add_builtin(e, "mem-stats", builtin_mem_stats);
+    lenv_add_builtin(e, "heap-limit", builtin_heap_limit);
+    lenv_add_builtin(e, "max-depth", builtin_max_depth);
+    lenv_add_builtin(e, "jit", builtin_jit);
+    lenv_add_builtin(e, "jit-stats", builtin_jit_stats);
+    lenv_add_builtin(e, "hashcons", builtin_hashcons);
+    lenv_add_builtin(e, "memo", builtin_memo);
+    lenv_add_builtin(e, "memo-stats", builtin_memo_stats);
 
     // Conditional functions
-    lenv_add_builtin(e, "<", builtin_lt);
-    lenv_add_builtin(e, ">", builtin_gt);
-    lenv_add_builtin(e, "<=", builtin_le);
-    lenv_add_builtin(e, ">=", builtin_ge);
-    lenv_add_builtin(e, "==", builtin_eq);
-    lenv_add_builtin(e, "!=", builtin_ne);
-
-    lenv_add_builtin(e, "if", builtin_if);
+    lenv_add_vector_builtin(e, "<", builtin_lt, builtin_lt_v, 1);
+    lenv_add_vector_builtin(e, ">", builtin_gt, builtin_gt_v, 1);
+    lenv_add_vector_builtin(e, "<=", builtin_le, builtin_le_v, 1);
+    lenv_add_vector_builtin(e, ">=", builtin_ge, builtin_ge_v, 1);
+    lenv_add_vector_builtin(e, "==", builtin_eq, builtin_eq_v, 1);
+    lenv_add_vector_builtin(e, "!=", builtin_ne, builtin_ne_v, 1);
+
+    lenv_add_vector_builtin(e, "if", builtin_if, builtin_if_v, 0);
+
+    lenv_add_pure_builtin(e, "and", builtin_and);
+    lenv_add_pure_builtin(e, "&&", builtin_and);
+    lenv_add_pure_builtin(e, "or", builtin_or);
+    lenv_add_pure_builtin(e, "||", builtin_or);
+    lenv_add_builtin(e, "cond", builtin_cond);
+
+    // Loops
+    lenv_add_builtin(e, "while", builtin_while);
+    lenv_add_builtin(e, "dotimes", builtin_dotimes);
+    lenv_add_builtin(e, "loop", builtin_loop);
+    lenv_add_builtin(e, "recur", builtin_recur);
+
+    // Macros
+    lenv_add_builtin(e, "defmacro", builtin_defmacro);
 
-    lenv_add_builtin(e, "and", builtin_and);
-    lenv_add_builtin(e, "&&", builtin_and);
-    lenv_add_builtin(e, "or", builtin_or);
-    lenv_add_builtin(e, "||", builtin_or);
+}
 
+// List the global layers from the base up, each name once
+static void lenv_ls(lenv* e, lenv* top, lval* x) {
+    if (e->par) { lenv_ls(e->par, top, x); }
+    for (int i = 0; i < e->count; i++) {
+        int seen = 0;
+        for (lenv* p = e->par; p && !seen; p = p->par) {
+            seen = lenv_find(p, e->syms[i], e->hashes[i]) != -1;
+        }
+        if (!seen) { lval_add(x, lval_sym(e->syms[i])); }
+    }
 }
 
 lval* builtin_ls(lenv* e, lval* a) {
     LASSERT_NUM("ls", a, 0)
 
     lval* x = lval_qexpr();
-    for (int i = 0; i < e->count; i++) {
-        lval_add(x, lval_sym(e->syms[i]));
+    if (e->frame) {
+        for (int i = 0; i < e->count; i++) {
+            lval_add(x, lval_sym(e->syms[i]));
+        }
+    } else {
+        lenv_ls(e, e, x);
     }
 
     lval_del(a);
     return x;
 }
 
-lval* lval_lambda(lval* formals, lval* body) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
+// Position each formal will be bound at, -1 if it is not a formal
+// Formals naming something twice have positions that depend on how
+// the call is made, so they all get -2
+static int lenv_formal_slot(lval* formals, lval* k) {
+    int slot = -1;
+    int n = 0;
+    for (int i = 0; i < formals->count; i++) {
+        lval* f = formals->cell[i];
+        if (strcmp(f->data.sym, "&") == 0) { continue; }
+        if (f->hash == k->hash && strcmp(f->data.sym, k->data.sym) == 0) { slot = n; }
+        n++;
+    }
+    for (int i = 0; slot != -1 && i < formals->count; i++) {
+        for (int j = 0; j < i; j++) {
+            if (formals->cell[j]->hash == formals->cell[i]->hash &&
+                strcmp(formals->cell[j]->data.sym, formals->cell[i]->data.sym) == 0) { return -2; }
+        }
+    }
+    return slot;
+}
+
+// Formals are bound in order into the frame of the call, whose parent
+// is e. Names bound in the frames of e are addressed there and anything
+// else that is currently global gets its cell cached
+static void lenv_resolve_in(lenv* e, lparams* p, lval* body) {
+    lenv* g = e;
+    while (g->frame) { g = g->par; }
+
+    // Expansions of macro calls run where the call is
+    if (body->expansion) { lenv_resolve_in(e, p, body->expansion); }
+
+    for (int i = 0; i < body->count; i++) {
+        lval* x = body->cell[i];
+        if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+            lenv_resolve_in(e, p, x);
+            continue;
+        }
+        if (x->type != LVAL_SYM || x->depth == LENV_GLOBAL) { continue; }
+
+        x->depth = LENV_UNRESOLVED;
+        x->cache = NULL;
+
+        int slot = lenv_formal_slot(p->syms, x);
+        if (slot == -2) { continue; }
+        if (slot != -1) {
+            x->depth = 0;
+            x->slot = slot;
+            x->owner = p->id;
+            continue;
+        }
 
-    // Set builtin to null
-    v->builtin = NULL;
+        int depth = 1;
+        for (lenv* f = e; f->frame; f = lenv_up(f), depth++) {
+            if ((slot = lenv_find_slot(f, x)) != -1) { break; }
+        }
+        if (slot != -1) {
+            x->depth = depth;
+            x->slot = slot;
+            x->owner = p->id;
+        } else {
+            // Global layers are searched from the session down to its base
+            for (lenv* l = g; l; l = l->par) {
+                if ((slot = lenv_find(l, x->data.sym, x->hash)) != -1) {
+                    x->cache = l->cells[slot];
+                    break;
+                }
+            }
+        }
+    }
+}
 
-    // Build new environment
-    v->env = lenv_new();
+void lenv_resolve(lenv* e, lparams* p) {
+    lenv_resolve_in(e, p, p->body);
+}
+
+static long lparams_count = 0;
+
+lparams* lparams_new(lval* syms, lval* body) {
+    lparams* p = (lparams*) lmem_xalloc(LVAL_FUN, sizeof(lparams));
+    p->refs = 1;
+    p->syms = syms;
+    p->body = body;
+    p->id = ++lparams_count;
+    p->slots = syms->count;
+    p->rest = -1;
+    for (int i = 0; i < syms->count; i++) {
+        if (strcmp(syms->cell[i]->data.sym, "&") == 0) {
+            p->slots--;
+            if (p->rest == -1) { p->rest = i; }
+        }
+    }
+    return p;
+}
+
+lparams* lparams_retain(lparams* p) {
+    if (p) { p->refs++; }
+    return p;
+}
+
+void lparams_release(lparams* p) {
+    if (p == NULL || --p->refs > 0) { return; }
+    lval_del(p->syms);
+    lval_del(p->body);
+    lmem_free(p);
+}
+
+lval* lval_lambda(lenv* env, lval* formals, lval* body) {
+    lval* v = lval_fun();
+
+    // Close over the defining environment
+    v->fun->env = lenv_retain(env);
 
     // Set formals and body
-    v->formals = formals;
-    v->body = body;
+    v->fun->params = lparams_new(formals, body);
     return v;
 }
 
+lval* lval_body(lval* f) {
+    return f->fun->params->body;
+}
+
 lval* builtin_lambda(lenv* e, lval* a) {
     // Check for two arguments each of which are Q-Expressions
     LASSERT_NUM("\\", a, 2)
@@ -191,7 +760,11 @@ lval* builtin_lambda(lenv* e, lval* a) {
     lval* body = lval_pop(a, 0);
     lval_del(a);
 
-    return lval_lambda(formals, body);
+    lmacro_expand_all(e, formals, body);
+    lval_fold(e, formals, body);
+    lval* f = lval_lambda(e, formals, body);
+    lenv_resolve(e, f->fun->params);
+    return f;
 }
 
 lval* builtin_var(lenv* e, lval* a, char* func) {
@@ -217,7 +790,12 @@ lval* builtin_var(lenv* e, lval* a, char* func) {
         }
         // If 'put' define it locally
         if (strcmp(func, "=") == 0) {
-            lenv_put(e, syms->cell[i], a->cell[i + 1]);
+            lenv* l = e;
+            while (l->loop && lenv_find(l, syms->cell[i]->data.sym, syms->cell[i]->hash) == -1) {
+                l = l->par;
+            }
+            lfold_rebind(l, syms->cell[i]);
+            lenv_put(l, syms->cell[i], a->cell[i + 1]);
         }
     }
 
@@ -232,86 +810,147 @@ lval* builtin_put(lenv* e, lval* a) {
     return builtin_var(e, a, "=");
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
-    // If builtin simply apply that
-    if (f->builtin) { return f->builtin(e, a); }
-
+lenv* lval_call_frame(lenv* e, lval* f, lval* a, lval** r) {
     // Record argument counts
+    lfun* fn = f->fun;
+    lval* formals = fn->params->syms;
     int given = a->count;
-    int total = f->formals->count;
-
-    // // While arguments still remain to be processed
+    int total = formals->count;
+    int rest = fn->params->rest;
+
+    // Arguments are bound into a new frame after those of a partial
+    // application, the closure itself is left untouched. The body runs
+    // in the session of the caller
+    lenv* frame = lenv_frame(fn->env, fn->params->slots - fn->bound);
+    frame->owner = fn->params->id;
+    frame->session = e->session;
+    int i = fn->bound;
+
+    // While arguments still remain to be processed
     while (a->count) {
         // If we've run out of formal arguments..
-        if (f->formals->count == 0) {
-            lval_del(a); 
-            return lval_err("Function passed too many arguments. "
-                "Got %i, Expected %i.", given, total);
+        if (i == total) {
+            lenv_pop(frame);
+            lval_del(a);
+            *r = lval_err("Function passed too many arguments. "
+                "Got %i, Expected %i.", given, total - fn->bound);
+            return NULL;
         }
 
-        // Pop the first symbol from the formals 
-        lval* sym = lval_pop(f->formals, 0);
-
-        if (strcmp(sym->data.sym, "&") == 0) {
+        if (i == rest) {
             // Ensure '&' is followed by another symbol
-            if (f->formals->count != 1) {
+            if (++i != total - 1) {
+                lenv_pop(frame);
                 lval_del(a);
-                return lval_err("Function format invalid."
+                *r = lval_err("Function format invalid."
                 "Symbol '&' not followed by single symbol.");
+                return NULL;
             }
 
             // Next formal should be bounded to remaining arguments
-            lval* nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym); lval_del(nsym);
+            lenv_bind_formal(frame, formals->cell[i++], builtin_list(e, a));
+            a = NULL;
             break;
         }
 
-        // Pop the next argument from the list
-        lval* val = lval_pop(a, 0);
-
-        // Bind a copy into the function's environment
-        lenv_put(f->env, sym, val);
-
-        // Delete the symbol and value
-        lval_del(sym); lval_del(val);
+        // Bind the next argument into the frame
+        lenv_bind_formal(frame, formals->cell[i++], lval_pop(a, 0));
     }
 
     // The argument list is now bounded so we can clean up the given
-    lval_del(a);
+    if (a) { lval_del(a); }
 
     // If '&' remains in formal list bind to empty list
-    if (f->formals->count > 0 &&
-        strcmp(f->formals->cell[0]->data.sym, "&") == 0) {
+    if (i < total && i == rest) {
             // Check to ensure that & is no passed invalidly
-            if (f->formals->count != 2) {
-                return lval_err("Function format invalid."
+            if (i != total - 2) {
+                lenv_pop(frame);
+                *r = lval_err("Function format invalid."
                 "Symbol '&' not followed by single symbol.");
+                return NULL;
             }
 
-            // Pop and delete '&' symbol
-            lval_del(lval_pop(f->formals, 0));
+            // Bind the symbol after '&' to an empty list
+            lenv_bind_formal(frame, formals->cell[i + 1], lval_qexpr());
+            i += 2;
+    }
+
+    // If all formals have been bounded the body can run
+    if (i == total) { return frame; }
+
+    // Otherwise return a closure over the bound arguments, sharing the
+    // formals and code of f. Bound arguments keep their positions so
+    // the same code still applies
+    frame->partial = 1;
+    lval* partial = lval_fun();
+    partial->fun->env = lenv_retain(frame);
+    partial->fun->params = lparams_retain(fn->params);
+    partial->fun->bound = i;
+    partial->fun->code = lvm_retain(lvm_code(f));
+    lenv_pop(frame);
+    *r = partial;
+    return NULL;
+}
 
-            // Pop next symbol and create empty list
-            lval* sym = lval_pop(f->formals, 0);
-            lval* val = lval_qexpr();
+lval* lval_call(lenv* e, lval* f, lval* a) {
+    // If builtin simply apply that
+    if (f->fun->builtin) { return f->fun->builtin(e, a); }
 
-            // Bind to environment and delete
-            lenv_put(f->env, sym, val);
-            lval_del(sym); lval_del(val);
+    // Macros only take code as written
+    if (f->fun->macro) {
+        lval_del(a);
+        return lval_err("Macro called with evaluated arguments. Call it by its name.");
     }
 
-    // If all formals have been bounded evaluate
-    if (f->formals->count == 0) {
-        // Set environment parent to evaluation environment
-        f->env->par = e;
+    // Memoized functions look the arguments up first
+    if (f->fun->memo) { return lmemo_call(e, f, a); }
+    return lval_call_lambda(e, f, a);
+}
 
-        // Evaluate and return
-        return builtin_eval(
-            f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-    } else {
-        // Otherwise return partially evaluated function
-        return lval_copy(f);
+lval* lval_call_lambda(lenv* e, lval* f, lval* a) {
+    // Calls made through builtins still nest on the C stack
+    if (lmem_stack_exhausted()) {
+        lval_del(a);
+        return lval_err("Out of stack space. Recursion too deep.");
     }
-    return lval_sexpr();
-}
\ No newline at end of file
+
+    lval* result;
+    if (lvm_enabled) {
+        // Compiled on the first call, the code is shared by later copies
+        lvm_code(f);
+        if (ljit_call(f, a->cell, a->count, &result)) {
+            lval_del(a);
+            return result;
+        }
+    }
+
+    lenv* frame = lval_call_frame(e, f, a, &result);
+    if (frame == NULL) { return result; }
+
+    // The machine pops the frame, or the last one it tail called
+    if (lvm_enabled) { return lvm_exec(frame, f->fun->code); }
+
+    // Calls in tail position of the body come back here to run in
+    // place of this one, so that the stack does not grow
+    if (lvm_depth >= lvm_max_depth) {
+        lenv_pop(frame);
+        return lvm_depth_err();
+    }
+    lvm_depth++;
+
+    // The body is run where it is, so it is never copied
+    lval* g = NULL;
+    while (1) {
+        result = lval_run(frame, lval_body(f), 1);
+        lenv_pop(frame);
+        if (result != &ltail.call) { break; }
+
+        if (g) { lval_del(g); }
+        f = g = ltail.f;
+        frame = lval_call_frame(e, f, ltail.a, &result);
+        if (frame == NULL) { break; }
+    }
+    if (g) { lval_del(g); }
+    lvm_depth--;
+    return result;
+}
@@ -2,28 +2,192 @@
 #define LVAL_ENVIRONMENT
 #include "base.h"
 
+// A binding holds its value in a cell that never moves
+// so that call sites can keep a pointer to it
+struct lcell {
+    lval* val;
+};
+
 struct lenv {
     // Represents the parent environment
     lenv* par;
+
+    // Whether this is a function frame rather than a global environment
+    // Frames are shared by the closures that capture them and counted
+    int frame;
+    int refs;
+
+    // Frame holding the arguments of a partial application
+    int partial;
+    // Formals held by the partial application frames above this one,
+    // which come first in lexical addresses
+    int bound;
+
+    // Frame of the variables of a loop, which '=' looks past for
+    // names it does not bind
+    int loop;
+
+    // Frame of a call: the number of the formals it binds
+    long owner;
+    // Frame that '=' has given a binding beyond its formals, which
+    // lexical addresses resolved past it do not know of
+    int extended;
+
+    // Base environment shared read only by sessions layered over it
+    int frozen;
+    // Session that definitions made here go to: a session itself, or
+    // for a frame the one running the code that made it
+    lenv* session;
+    // Session: the number of the heap budget its forms are charged to
+    int budget;
+
+    // Call frames keep their bindings in the frame stack region and
+    // borrow the names of the formals until they are moved to the heap
+    int stack;
+    long base;
+
+    // Bindings in insertion order, grown geometrically
     int count;
+    int capacity;
     char** syms;
-    lval** vals;
+    lcell** cells;
+    unsigned long* hashes;
+
+    // Open addressing table of binding positions (-1 when empty)
+    // Only built once the environment outgrows a linear scan
+    int* index;
+    int index_size;
 };
 
+// Hash of a symbol name
+unsigned long lenv_hash(char* sym);
+
+// Depth of a symbol without a lexical address
+#define LENV_UNRESOLVED -1
+// Depth of a symbol a macro template brought in, which only names globals
+#define LENV_GLOBAL -2
+
+/*
+    Lexical addresses
+    Symbols of a lambda body that name a formal, or a binding in the
+    frames the lambda closes over, get the number of frames up and the
+    position there. The formals are numbered, and so are the frames of
+    calls to them, so an address is only followed where the code runs
+    in a call of the lambda it was resolved for. Anywhere else, or past
+    a frame '=' has added to, the name is searched for instead.
+*/
+void lenv_resolve(lenv* e, lparams* p);
+
 lenv* lenv_new(void);
 void lenv_del(lenv* e);
 lenv* lenv_copy(lenv* e);
 
+/*
+    Sessions
+    A base environment holding the builtins and any library loaded on
+    top is frozen once and then shared by every session. A session is a
+    thin global layer over it that receives its own definitions, so
+    creating one costs a single empty environment. Each frame records
+    the session of its caller, so functions of the base define into the
+    session calling them. Each session has its own heap budget as well.
+    Sessions are single-threaded: they share the evaluator's own state
+    (the frame stack, shadow counts, VM stacks, tail call, fold epochs
+    and the budget charged), so only one form of any session may run at
+    a time, and all on the same thread.
+*/
+void lenv_freeze(lenv* base);
+lenv* lenv_session(lenv* base);
+
+// Take and drop a reference to a captured environment
+// Global environments outlive their closures and are not counted
+lenv* lenv_retain(lenv* e);
+void lenv_release(lenv* e);
+
+// Push a frame for a call of a closure over e with room for the given
+// number of formals, and pop it once the call returns
+// Frames still captured by a closure when popped are moved to the heap
+lenv* lenv_frame(lenv* e, int formals);
+void lenv_pop(lenv* e);
+long lenv_stack_usage(void);
+
 // Obtain a variable from the environment
 // e is the environment
 // k is the symbol
 lval* lenv_get(lenv* e, lval* k);
+// Same as lenv_get without copying, NULL if unbound
+lval* lenv_lookup(lenv* e, lval* k);
 void lenv_put(lenv* e, lval* k, lval* v);
+// Same as lenv_put but takes ownership of v
+void lenv_bind(lenv* e, lval* k, lval* v);
+// Bind a formal of the function being called into its frame
+void lenv_bind_formal(lenv* e, lval* k, lval* v);
 void lenv_def(lenv* e, lval* k, lval* v);
 
+/*
+    Formals and body of a lambda
+    Neither changes once the lambda is made, so copies of it and the
+    closures left by partial application share them, along with the
+    number of frame slots the formals need and where '&' is. The body
+    only ever gains what is cached on its nodes, such as expansions of
+    macro calls, which holds for every copy alike.
+*/
+struct lparams {
+    int refs;
+    lval* syms;
+    int slots;
+    // Position of '&', or -1 when every argument has a formal
+    int rest;
+    lval* body;
+    // Never reused, and carried by the frames of calls
+    long id;
+};
+
+// Takes the Q-Expressions of symbols and of the body
+lparams* lparams_new(lval* syms, lval* body);
+lparams* lparams_retain(lparams* p);
+void lparams_release(lparams* p);
+
+/*
+    Functions
+    A function value only points at what it is, which copies of it share
+    and count. Whatever changes one of them, such as memoizing it, gives
+    it one of its own first.
+*/
+struct lfun {
+    int refs;
+
+    lbuiltin builtin;
+    // Builtin: no side effects, so calls on constants can be folded
+    int pure;
+    // Builtin: the same function over a vector of arguments, if it has one
+    lbuiltin_v vbuiltin;
+
+    lenv* env;
+    // Lambda: formals and body, and how many of the formals partial
+    // application has already bound
+    lparams* params;
+    int bound;
+    // Lambda: compiled body, shared with partial applications of it
+    lcode* code;
+    // Lambda: table of results when memoized
+    lmemo* memo;
+    // Macro: its number, never reused, and 0 for other functions
+    int macro;
+};
+
+lfun* lfun_retain(lfun* f);
+void lfun_release(lfun* f);
+// A function of its own holding what f does, to be changed apart from it
+lfun* lfun_copy(lfun* f);
+
 lval* lval_builtin(lbuiltin func);
+lval* lval_lambda(lenv* env, lval* formals, lval* body);
+// Body of a lambda, shared by its copies
+lval* lval_body(lval* f);
 
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func);
+void lenv_add_pure_builtin(lenv* e, char* name, lbuiltin func);
+void lenv_add_vector_builtin(lenv* e, char* name, lbuiltin func, lbuiltin_v vfunc, int pure);
 void lenv_add_builtins(lenv* e);
 
 lval* builtin_def(lenv* e, lval* a);
@@ -33,6 +197,15 @@ lval* builtin_def(lenv* e, lval* a);
 lval* builtin_put(lenv* e, lval* a);
 lval* builtin_var(lenv* e, lval* a, char* func);
 
+/*
+    Calling a lambda
+    lval_call_frame binds the arguments into a new frame, ready for the
+    body to run. When the call ends early, on an error or as a partial
+    application, it returns NULL and leaves the result in r instead.
+*/
+lenv* lval_call_frame(lenv* e, lval* f, lval* a, lval** r);
 lval* lval_call(lenv* e, lval* f, lval* a);
+// Same for a lambda, passing by its memo table if it has one
+lval* lval_call_lambda(lenv* e, lval* f, lval* a);
 
 #endif
@@ -3,23 +3,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include "error.h"
+#include "memory.h"
 
 lval* lval_err(char* fmt, ...) {
-	lval* v = (lval *) malloc(sizeof(lval));
-	v->type = LVAL_ERR;
+	lval* v = lval_alloc(LVAL_ERR);
 
 	// Create a va list and initialize it
 	va_list va;
 	va_start(va, fmt);
 
 	// Allocate 512 bytes of space	
-	v->data.err = (char *) malloc(512);
+	v->data.err = (char *) lmem_xalloc(LVAL_ERR, 512);
 
 	//printf the error string with a maximum of 511 characters
 	vsnprintf(v->data.err, 511, fmt, va);
 
 	// Reallocate to the number of actual bytes
-	v->data.err = realloc(v->data.err, strlen(v->data.err) + 1);
+	v->data.err = lmem_xrealloc(LVAL_ERR, v->data.err, strlen(v->data.err) + 1);
 
 	// Cleanup our va list
 	va_end(va);
@@ -32,6 +32,8 @@ char* ltype_name(int t) {
     case LVAL_FUN: return "Function";
     case LVAL_LONG: return "Long";
 	case LVAL_DOUBLE: return "Double";
+    case LVAL_BIGINT: return "BigInt";
+    case LVAL_THUNK: return "Delay";
     case LVAL_ERR: return "Error";
     case LVAL_SYM: return "Symbol";
     case LVAL_SEXPR: return "S-Expression";
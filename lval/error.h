@@ -29,4 +29,30 @@ char* ltype_name(int t);
   LASSERT(args, args->cell[index]->count != 0, \
     "Function '%s' passed {} for argument %i.", func, index);
 
+// The same checks for builtins taking a vector of arguments
+void lval_del_args(int argc, lval** argv);
+
+#define LASSERT_V(argc, argv, cond, fmt, ...) \
+  if (!(cond)) { \
+    lval* err = lval_err(fmt, ##__VA_ARGS__); \
+    lval_del_args(argc, argv); \
+    return err; \
+  }
+
+#define LASSERT_TYPE_V(func, argc, argv, index, expect) \
+  LASSERT_V(argc, argv, argv[index]->type == expect, \
+    "Function '%s' passed incorrect type for argument %i. " \
+    "Got %s, Expected %s.", \
+    func, index, ltype_name(argv[index]->type), ltype_name(expect))
+
+#define LASSERT_NUM_V(func, argc, argv, num) \
+  LASSERT_V(argc, argv, argc == num, \
+    "Function '%s' passed incorrect number of arguments. " \
+    "Got %i, Expected %i.", \
+    func, argc, num)
+
+#define LASSERT_NOT_EMPTY_V(func, argc, argv, index) \
+  LASSERT_V(argc, argv, argv[index]->count != 0, \
+    "Function '%s' passed {} for argument %i.", func, index);
+
 #endif
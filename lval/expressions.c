@@ -7,33 +7,45 @@
 #include "numbers.h"
 #include "operations.h"
 #include "error.h"
+#include "memory.h"
+#include "jit.h"
+#include "vm.h"
+#include "conditionals.h"
+#include "loop.h"
+#include "macro.h"
+#include "fold.h"
 
 // Think about where to put these declarations later
 lval* builtin(lval* a, char* func);
-lval* builtin_op(lval* v, char* op);
 
 lval* lval_sexpr(void) {
-	lval* v = (lval *) malloc(sizeof(lval));
-	v->type = LVAL_SEXPR;
-	v->count = 0;
-	v->cell = NULL;
+	lval* v = lval_alloc(LVAL_SEXPR);
 	return v;
 }
 lval* lval_qexpr(void) {
-	lval* v = (lval *) malloc(sizeof(lval));
-	v->type = LVAL_QEXPR;
-	v->count = 0;
-	v->cell = NULL;
+	lval* v = lval_alloc(LVAL_QEXPR);
 	return v;
 }
 
 lval* lval_add(lval* v, lval* x) {
 	v->count++;
-	v->cell = (lval **) realloc(v->cell, sizeof(lval*) * v->count);
+	v->cell = (lval **) lmem_xrealloc(v->type, v->cell, sizeof(lval*) * v->count);
 	v->cell[v->count - 1] = x;
 	return v;
 }
 
+lval* lval_append(lval* v, lval* x) {
+	lval** cell = (lval**) lmem_realloc(v->type, v->cell, sizeof(lval*) * (v->count + 1));
+	if (cell == NULL) {
+		lval_del(v);
+		lval_del(x);
+		return lmem_err();
+	}
+	v->cell = cell;
+	v->cell[v->count++] = x;
+	return v;
+}
+
 lval* lval_pop(lval* v, int i) {
 	// Find the item at i
 	lval* x = v->cell[i];
@@ -45,7 +57,7 @@ lval* lval_pop(lval* v, int i) {
 	v->count--;
 
 	// Reallocate the memory used
-	v->cell = (lval **) realloc(v->cell, sizeof(lval*) * v->count);
+	v->cell = (lval **) lmem_xrealloc(v->type, v->cell, sizeof(lval*) * v->count);
 	return x;
 }
 
@@ -55,25 +67,114 @@ lval* lval_take(lval* v, int i) {
 	return x;
 }
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
+lval* lval_call_vector(lenv* e, lbuiltin_v f, lval* a) {
+	// The values go to f, the list holding them is ours
+	lval* r = f(e, a->count, a->cell);
+	a->count = 0;
+	lval_del(a);
+	return r;
+}
+
+ltail_state ltail;
+
+static lval* lval_run_one(lenv* e, lval* x);
+static lval* lval_run_head(lenv* e, lval* x);
+
+// (== a b) and (!= a b) on bound symbols compare the values where they
+// are bound instead of copies of them, NULL when that does not apply
+static lval* lval_run_eq(lenv* e, lbuiltin builtin, lval* x) {
+	if ((builtin != builtin_eq && builtin != builtin_ne) || x->count != 3 ||
+		x->cell[1]->type != LVAL_SYM || x->cell[2]->type != LVAL_SYM || lmem_exhausted()) {
+		return NULL;
+	}
+	lval* a = lenv_lookup(e, x->cell[1]);
+	lval* b = lenv_lookup(e, x->cell[2]);
+	if (a == NULL || b == NULL || a->type == LVAL_ERR || b->type == LVAL_ERR) { return NULL; }
+	return lval_long(lval_eq(a, b) == (builtin == builtin_eq));
+}
+
+// The arguments of 'and' and 'or' are evaluated from the left only as
+// far as it takes to decide the result, NULL for other calls
+static lval* lval_run_logic(lenv* e, lbuiltin builtin, lval* x) {
+	if (builtin != builtin_and && builtin != builtin_or) { return NULL; }
+	for (int i = 1; i < x->count; i++) {
+		lval* r = lval_logic_step(builtin, lval_run_one(e, x->cell[i]), i - 1);
+		if (r) { return r; }
+	}
+	return lval_long(builtin == builtin_and);
+}
+
+// Discard results built past the heap budget, and errors raised on
+// the way for what was refused
+static lval* lval_result(lval* result) {
+	if (lmem_exhausted() && result != &ltail.call) {
+		lval_del(result);
+		return lmem_err();
+	}
+	return result;
+}
+
+// Run what code x was folded to
+static lval* lval_run_folded(lenv* e, lval* x, int tail) {
+	lval* r = x->expansion;
+	return r->type == LVAL_SEXPR ? lval_run(e, r, tail) : lval_copy(r);
+}
+
+lval* lval_eval_sexpr(lenv* e, lval* v, int tail) {
+	if (LFOLD_HOLDS(v)) {
+		lval* r = lval_run_folded(e, v, tail);
+		lval_del(v);
+		return r;
+	}
+
 	// No argument functions
 	if (v->count == 1 && v->cell[0]->type == LVAL_SYM) {
 		if (strcmp(v->cell[0]->data.sym, "exit") == 0) { return v; }
-		lval* x = lenv_get(e, v->cell[0]);
+		lval* x = lenv_lookup(e, v->cell[0]);
+		if (x == NULL) { return lval_eval(e, lval_take(v, 0)); }
+		if (x->type == LVAL_FUN && x->fun->macro) {
+			lval* r = lmacro_run(e, x, v, tail);
+			lval_del(v);
+			return r;
+		}
 		if (x->type == LVAL_FUN) {
-			lval_del(x);
-			if (strcmp(v->cell[0]->data.sym, "ls") == 0) {
+			// Builtins reporting on the session are called with no
+			// arguments, going by what the name is bound to
+			lbuiltin b = x->fun->builtin;
+			if (b == builtin_ls || b == builtin_mem_stats || b == builtin_jit_stats) {
 				lval_del(v);
-				return builtin_ls(e, lval_sexpr());
+				return b(e, lval_sexpr());
 			}
 			return v;
 		}
-		if (x->type == LVAL_ERR) { lval_del(v); return x; }
-		lval_del(x);
+		if (x->type == LVAL_ERR) { lval_del(v); return lval_copy(x); }
 		return v;
 	}
-	// Evaluate children
-	for (int i = 0; i < v->count; i++) {
+
+	// Builtins are called straight from their cell instead of being copied
+	lbuiltin builtin = NULL;
+	lbuiltin_v vbuiltin = NULL;
+	if (v->count > 1 && v->cell[0]->type == LVAL_SYM) {
+		lval* x = lenv_lookup(e, v->cell[0]);
+		if (x && x->type == LVAL_FUN && x->fun->macro) {
+			lval* r = lmacro_run(e, x, v, tail);
+			lval_del(v);
+			return r;
+		}
+		if (x && x->type == LVAL_FUN) { builtin = x->fun->builtin; vbuiltin = x->fun->vbuiltin; }
+	}
+
+	lval* eq = lval_run_eq(e, builtin, v);
+	if (!eq) { eq = lval_run_logic(e, builtin, v); }
+	if (eq) { lval_del(v); return eq; }
+
+	// Evaluate children, where a lambda at the head keeps its body shared
+	if (!builtin && v->count > 1) {
+		lval* f = lval_run_head(e, v->cell[0]);
+		lval_del(v->cell[0]);
+		v->cell[0] = f;
+	}
+	for (int i = builtin || v->count > 1 ? 1 : 0; i < v->count; i++) {
 		v->cell[i] = lval_eval(e, v->cell[i]);
 	}
 
@@ -88,20 +189,189 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
 	// Single expression
 	if (v->count == 1) { return lval_eval(e, lval_take(v, 0)); }
 
-	// Ensure first element is a symbol otherwise
-	lval* f = lval_pop(v, 0);
-	if (f->type != LVAL_FUN) {
-		lval* err = lval_err(
-			"S-Experssion starts with incorrect type. "
-			"Got %s, Expected %s.",
-			ltype_name(f->type), ltype_name(LVAL_FUN));
-		lval_del(f); lval_del(v);
-		return err;
-	}
-	// If so call the function and return result
-	lval* result = lval_call(e, f, v);
-	lval_del(f);
-	return result;
+	lval* result;
+	if (builtin) {
+		// The branch of 'if' and the expression of 'eval' stay in tail position
+		ltail.pos = tail && (builtin == builtin_if || builtin == builtin_eval ||
+			builtin == builtin_cond || builtin == builtin_recur);
+		if (vbuiltin) {
+			// The arguments are passed where they are, after the head
+			lval_del(v->cell[0]);
+			result = vbuiltin(e, v->count - 1, v->cell + 1);
+			v->count = 0;
+			lval_del(v);
+		} else {
+			lval_del(lval_pop(v, 0));
+			result = builtin(e, v);
+		}
+		ltail.pos = 0;
+	} else {
+		// Ensure first element is a symbol otherwise
+		lval* f = lval_pop(v, 0);
+		if (f->type != LVAL_FUN) {
+			lval* err = lval_err(
+				"S-Experssion starts with incorrect type. "
+				"Got %s, Expected %s.",
+				ltype_name(f->type), ltype_name(LVAL_FUN));
+			lval_del(f); lval_del(v);
+			return err;
+		}
+		// Calls in tail position are left to the lval_call running the body
+		if (tail && !f->fun->builtin && !f->fun->memo && !f->fun->macro) {
+			ltail.f = f;
+			ltail.a = v;
+			return &ltail.call;
+		}
+
+		// If so call the function and return result
+		result = lval_call(e, f, v);
+		lval_del(f);
+	}
+	return lval_result(result);
+}
+
+// Value of the code x, leaving x as it is
+static lval* lval_run_one(lenv* e, lval* x) {
+	if (lmem_exhausted()) { return lmem_err(); }
+	switch (x->type) {
+		case LVAL_SYM: return lenv_get(e, x);
+		case LVAL_SEXPR: return lval_run(e, x, 0);
+		default: return lval_copy(x);
+	}
+}
+
+// Value of the head of a call: lambdas share their body rather than copy it
+static lval* lval_run_head(lenv* e, lval* x) {
+	if (x->type != LVAL_SYM || lmem_exhausted()) { return lval_run_one(e, x); }
+	lval* f = lenv_lookup(e, x);
+	if (f && f->type == LVAL_FUN && !f->fun->builtin && !f->fun->memo) { return lvm_pin(f); }
+	return lenv_get(e, x);
+}
+
+lval* lval_run(lenv* e, lval* x, int tail) {
+	if (lmem_exhausted()) { return lmem_err(); }
+	if (LFOLD_HOLDS(x)) { return lval_run_folded(e, x, tail); }
+
+	// Empty and single symbol expressions are rare enough to be copied
+	if (x->count == 0 || (x->count == 1 && x->cell[0]->type == LVAL_SYM)) {
+		lval* v = lval_copy(x);
+		if (v->type == LVAL_ERR) { return v; }
+		if (v->type == LVAL_QEXPR) { lval_retype(v, LVAL_SEXPR); }
+		return lval_eval_sexpr(e, v, tail);
+	}
+
+	// A single expression is evaluated again
+	if (x->count == 1) {
+		lval* v = lval_run_one(e, x->cell[0]);
+		return v->type == LVAL_ERR ? v : lval_eval(e, v);
+	}
+
+	lbuiltin builtin = NULL;
+	lbuiltin_v vbuiltin = NULL;
+	if (x->cell[0]->type == LVAL_SYM) {
+		lval* h = lenv_lookup(e, x->cell[0]);
+		// Macro calls run the code they expand to, kept on x
+		if (h && h->type == LVAL_FUN && h->fun->macro) { return lval_result(lmacro_run(e, h, x, tail)); }
+		if (h && h->type == LVAL_FUN) { builtin = h->fun->builtin; vbuiltin = h->fun->vbuiltin; }
+	}
+
+	lval* eq = lval_run_eq(e, builtin, x);
+	if (!eq) { eq = lval_run_logic(e, builtin, x); }
+	if (eq) { return eq; }
+
+	// The branches of 'if' and 'cond' and the expression of 'eval' run
+	// where they are
+	if (builtin == builtin_eval && x->count == 2 && x->cell[1]->type == LVAL_QEXPR) {
+		return lval_result(lval_run(e, x->cell[1], tail));
+	}
+	if (builtin == builtin_cond && lval_cond_form(x)) {
+		for (int i = 1; i < x->count; i++) {
+			lval* t = lval_cond_test(lval_run_one(e, x->cell[i]->cell[0]), i - 1);
+			if (t->type == LVAL_ERR) { return t; }
+			int taken = t->data.num != 0;
+			lval_del(t);
+			if (taken) {
+				lval* body = x->cell[i]->cell[1];
+				return lval_result(body->type == LVAL_SEXPR
+					? lval_run(e, body, tail) : lval_run_one(e, body));
+			}
+		}
+		return lval_sexpr();
+	}
+	lval* cond = NULL;
+	if (builtin == builtin_if && x->count == 4 &&
+		x->cell[2]->type == LVAL_QEXPR && x->cell[3]->type == LVAL_QEXPR) {
+		cond = lval_run_one(e, x->cell[1]);
+		if (cond->type == LVAL_LONG) {
+			lval* branch = cond->data.num ? x->cell[2] : x->cell[3];
+			lval_del(cond);
+			return lval_result(lval_run(e, branch, tail));
+		}
+	}
+
+	// Short calls of vector builtins keep their arguments on the stack
+	int argc = x->count - 1;
+	if (vbuiltin && argc <= LVAL_ARGS_MAX) {
+		lval* argv[LVAL_ARGS_MAX];
+		for (int i = 0; i < argc; i++) {
+			argv[i] = i == 0 && cond ? cond : lval_run_one(e, x->cell[i + 1]);
+		}
+		for (int i = 0; i < argc; i++) {
+			if (argv[i]->type == LVAL_ERR) {
+				lval* err = argv[i];
+				argv[i] = argv[argc - 1];
+				lval_del_args(argc - 1, argv);
+				return err;
+			}
+		}
+		ltail.pos = tail && builtin == builtin_if;
+		lval* result = vbuiltin(e, argc, argv);
+		ltail.pos = 0;
+		return lval_result(result);
+	}
+
+	// Results go to a list of their own
+	lval* f = builtin ? NULL : lval_run_head(e, x->cell[0]);
+	lval* a = lval_sexpr();
+	a->count = x->count - 1;
+	a->cell = (lval**) lmem_xalloc(LVAL_SEXPR, sizeof(lval*) * a->count);
+	for (int i = 1; i < x->count; i++) {
+		a->cell[i - 1] = i == 1 && cond ? cond : lval_run_one(e, x->cell[i]);
+	}
+
+	// The first error in evaluation order is the result
+	if (f && f->type == LVAL_ERR) { lval_del(a); return f; }
+	for (int i = 0; i < a->count; i++) {
+		if (a->cell[i]->type == LVAL_ERR) {
+			if (f) { lval_del(f); }
+			return lval_take(a, i);
+		}
+	}
+
+	lval* result;
+	if (builtin) {
+		ltail.pos = tail && (builtin == builtin_if || builtin == builtin_eval ||
+			builtin == builtin_cond || builtin == builtin_recur);
+		result = builtin(e, a);
+		ltail.pos = 0;
+	} else {
+		if (f->type != LVAL_FUN) {
+			lval* err = lval_err(
+				"S-Experssion starts with incorrect type. "
+				"Got %s, Expected %s.",
+				ltype_name(f->type), ltype_name(LVAL_FUN));
+			lval_del(f); lval_del(a);
+			return err;
+		}
+		if (tail && !f->fun->builtin && !f->fun->memo && !f->fun->macro) {
+			ltail.f = f;
+			ltail.a = a;
+			return &ltail.call;
+		}
+		result = lval_call(e, f, a);
+		lval_del(f);
+	}
+	return lval_result(result);
 }
 
 
@@ -115,8 +385,21 @@ lval* builtin_headn(lenv* e, lval* a, int n) {
 	return v;
 }
 
+lval* builtin_head_v(lenv* e, int argc, lval** argv) {
+	LASSERT_NUM_V("head", argc, argv, 1)
+	LASSERT_TYPE_V("head", argc, argv, 0, LVAL_QEXPR)
+	LASSERT_NOT_EMPTY_V("head", argc, argv, 0)
+
+	// Drop the rest in one go
+	lval* v = argv[0];
+	for (int i = 1; i < v->count; i++) { lval_del(v->cell[i]); }
+	v->count = 1;
+	v->cell = (lval**) lmem_xrealloc(v->type, v->cell, sizeof(lval*));
+	return v;
+}
+
 lval* builtin_head(lenv* e, lval* a) {
-	return builtin_headn(e, a, 1);
+	return lval_call_vector(e, builtin_head_v, a);
 }
 
 lval* builtin_init(lenv* e, lval* a) {
@@ -127,18 +410,22 @@ lval* builtin_init(lenv* e, lval* a) {
 }
 
 
-lval* builtin_tail(lenv* e, lval* a) {
-	LASSERT_NUM("tail", a, 1)
-	LASSERT_TYPE("tail", a, 0, LVAL_QEXPR)
-	LASSERT_NOT_EMPTY("tail", a, 0)
+lval* builtin_tail_v(lenv* e, int argc, lval** argv) {
+	LASSERT_NUM_V("tail", argc, argv, 1)
+	LASSERT_TYPE_V("tail", argc, argv, 0, LVAL_QEXPR)
+	LASSERT_NOT_EMPTY_V("tail", argc, argv, 0)
 
-	lval* v = lval_take(a, 0);
+	lval* v = argv[0];
 	lval_del(lval_pop(v, 0));
 	return v;
 }
 
+lval* builtin_tail(lenv* e, lval* a) {
+	return lval_call_vector(e, builtin_tail_v, a);
+}
+
 lval* builtin_list(lenv* e, lval* a) {
-	a->type = LVAL_QEXPR;
+	lval_retype(a, LVAL_QEXPR);
 	return a;
 }
 
@@ -147,17 +434,25 @@ lval* builtin_eval(lenv* e, lval* a) {
 	LASSERT_TYPE("eval", a, 0, LVAL_QEXPR)
 
 	lval* x = lval_take(a, 0);
-	x->type = LVAL_SEXPR;
+	lval_retype(x, LVAL_SEXPR);
 	return lval_eval(e, x);
 }
 
 lval* lval_join(lenv* e, lval* x, lval* y) {
-	// For each cell in 'y' add it to 'x'
-	while (y->count) {
-		x = lval_add(x, lval_pop(y, 0));
+	// Make room for the cells of 'y' at the end of 'x' in one go
+	int n = x->count + y->count;
+	lval** cell = (lval**) lmem_realloc(x->type, x->cell, sizeof(lval*) * n);
+	if (cell == NULL && n) {
+		lval_del(x);
+		lval_del(y);
+		return lmem_err();
 	}
+	x->cell = cell;
+	if (y->count) { memcpy(&x->cell[x->count], y->cell, sizeof(lval*) * y->count); }
+	x->count = n;
 
-	// Delete the empty y and return x
+	// Delete the emptied y and return x
+	y->count = 0;
 	lval_del(y);
 	return x;
 }
@@ -169,7 +464,7 @@ lval* builtin_join(lenv* e, lval* a) {
 
 	lval* x = lval_pop(a, 0);
 	
-	while (a->count) {
+	while (a->count && x->type != LVAL_ERR) {
 		x = lval_join(e, x, lval_pop(a, 0));
 	}
 
@@ -177,14 +472,18 @@ lval* builtin_join(lenv* e, lval* a) {
 	return x;
 }
 
-lval* builtin_len(lenv* e, lval* a) {
-	LASSERT_TYPE("len", a, 0, LVAL_QEXPR)
-	lval* x = lval_long(a->cell[0]->count);
-	
-	lval_del(a);
+lval* builtin_len_v(lenv* e, int argc, lval** argv) {
+	LASSERT_TYPE_V("len", argc, argv, 0, LVAL_QEXPR)
+	lval* x = lval_long(argv[0]->count);
+
+	lval_del_args(argc, argv);
 	return x;
 }
 
+lval* builtin_len(lenv* e, lval* a) {
+	return lval_call_vector(e, builtin_len_v, a);
+}
+
 lval* builtin_cons(lenv* e, lval* a) {
 	LASSERT(a, a->cell[0]->type != LVAL_QEXPR, "Function 'cons' passed incorrect type on first argument. Got %s, expected not %s",
 		ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR))
@@ -13,15 +13,54 @@ lval* lval_qexpr(void);
     expressions from the group
 */
 lval* lval_add(lval* v, lval* x);
+// Add an expression, or give both back as the error when the heap
+// budget refuses the room for it
+lval* lval_append(lval* v, lval* x);
 // Remove an expression from the group and return it 
 lval* lval_pop(lval* v, int i);
 // Remove an expression from the group and delete the rest the group
 lval* lval_take(lval* v, int i);
 
+/*
+    Vector builtins
+    Builtins on the hot path also take their arguments as a vector
+    borrowed from the caller, so that no list has to be built to hold
+    them. They own the values in it and leave the vector itself alone.
+    Calls with up to LVAL_ARGS_MAX arguments pass them on the C stack.
+*/
+#define LVAL_ARGS_MAX 8
+
+// Apply f to the elements of the list a, which is deleted
+lval* lval_call_vector(lenv* e, lbuiltin_v f, lval* a);
+
 /* ----------------------------------------------------*/
 
 // Adds the ability to evalutate each expression in the group
-lval* lval_eval_sexpr(lenv* e, lval* v);
+lval* lval_eval_sexpr(lenv* e, lval* v, int tail);
+
+// Evaluate the code x as an S-Expression without taking it apart, so
+// that bodies and branches can be run again without being copied
+lval* lval_run(lenv* e, lval* x, int tail);
+
+/*
+    Tail calls
+    The body of a lambda, and the branch of 'if' or 'cond' or the
+    expression of 'eval' in tail position of one, hands its final
+    call back to lval_call instead of making it. The call is left here
+    and the address of call returned in place of a result.
+    'recur' in tail position of the body of 'loop' leaves its arguments
+    the same way, with no function.
+*/
+typedef struct ltail_state {
+    // Set just before evaluating an expression in tail position
+    int pos;
+    lval* f;
+    lval* a;
+    lval call;
+} ltail_state;
+
+// Shared by all sessions, which run on a single thread
+extern ltail_state ltail;
 
 /*
     QEXPR Operations
@@ -35,13 +74,16 @@ lval* lval_eval_sexpr(lenv* e, lval* v);
 */
 lval* builtin_headn(lenv* e, lval* a, int n);
 lval* builtin_head(lenv* e, lval* a);
+lval* builtin_head_v(lenv* e, int argc, lval** argv);
 lval* builtin_init(lenv* e, lval* a);
 lval* builtin_tail(lenv* e, lval* a);
+lval* builtin_tail_v(lenv* e, int argc, lval** argv);
 lval* builtin_list(lenv* e, lval* a);
 lval* builtin_eval(lenv* e, lval* a);
 lval* lval_join(lenv* e, lval* x, lval* y);
 lval* builtin_join(lenv* e, lval* a);
 lval* builtin_len(lenv* e, lval* a);
+lval* builtin_len_v(lenv* e, int argc, lval** argv);
 lval* builtin_cons(lenv* e, lval* a);
 
 #endif
@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <string.h>
+#include "fold.h"
+#include "environment.h"
+#include "expressions.h"
+#include "operations.h"
+#include "conditionals.h"
+#include "memory.h"
+
+// The function that head calls, if it can be told before the body runs
+static lfun* lfold_head(lenv* e, lval* formals, lval* head) {
+	if (head->type != LVAL_SYM) { return NULL; }
+	for (int i = 0; i < formals->count; i++) {
+		if (strcmp(formals->cell[i]->data.sym, head->data.sym) == 0) { return NULL; }
+	}
+	lval* x = lenv_lookup(e, head);
+	return x && x->type == LVAL_FUN ? x->fun : NULL;
+}
+
+// Fixed size numbers, which evaluate to themselves and are cheap to
+// work on
+static int lfold_const(lval* x) {
+	return x->type == LVAL_LONG || x->type == LVAL_DOUBLE;
+}
+
+int lfold_epoch = 0;
+
+// Epoch each name was last rebound in, by hash bucket
+#define LFOLD_NAMES 1024
+static int lfold_rebound[LFOLD_NAMES];
+
+void lfold_rebind(lenv* e, lval* k) {
+	lval* x = lenv_lookup(e, k);
+	if (x && x->type == LVAL_FUN && x->fun->builtin && (x->fun->pure || x->fun->builtin == builtin_if)) {
+		lfold_rebound[k->hash & (LFOLD_NAMES - 1)] = ++lfold_epoch;
+	}
+}
+
+// Whether none of the heads folded list x went through has been
+// rebound since the epoch
+static int lfold_fresh(lval* x, int epoch) {
+	if (lfold_rebound[x->cell[0]->hash & (LFOLD_NAMES - 1)] > epoch) { return 0; }
+	for (int i = 1; i < x->count; i++) {
+		lval* y = x->cell[i];
+		if (y->type == LVAL_SEXPR && y->expansion && y->macro == 0 && !lfold_fresh(y, epoch)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int lfold_renew(lval* x) {
+	if (!lfold_fresh(x, x->fold)) { return 0; }
+	x->fold = lfold_epoch;
+	return 1;
+}
+
+// The value x stands for before the body runs, or NULL
+static lval* lfold_value(lval* x) {
+	if (x->type == LVAL_SEXPR && LFOLD_HOLDS(x) && x->expansion->type != LVAL_SEXPR) {
+		return x->expansion;
+	}
+	return lfold_const(x) ? x : NULL;
+}
+
+static lval* lfold_code(lenv* e, lval* formals, lval* x);
+
+// Fold code x, a call or a Q-Expression run as one such as a body or a
+// branch, keeping what it folds to on x as its expansion
+static void lfold_keep(lenv* e, lval* formals, lval* x) {
+	lval* r = lfold_code(e, formals, x);
+	if (r == NULL) { return; }
+	if (x->expansion) { lval_del(x->expansion); }
+	x->expansion = r;
+	x->macro = 0;
+	x->fold = lfold_epoch;
+}
+
+// Fold element i of x when it is an S-Expression
+static void lfold_cell(lenv* e, lval* formals, lval* x, int i) {
+	if (x->cell[i]->type == LVAL_SEXPR) { lfold_keep(e, formals, x->cell[i]); }
+}
+
+// Fold the elements of x, which run as a call, then the call itself
+// Returns its value when constant, a copy of the branch taken by an
+// 'if' as an S-Expression, or NULL when x does not fold
+static lval* lfold_code(lenv* e, lval* formals, lval* x) {
+	if (x->count < 2) { return NULL; }
+	lfun* f = lfold_head(e, formals, x->cell[0]);
+
+	// Macros are given their arguments as written
+	if (f && f->macro) { return NULL; }
+	if (f && !f->builtin) { f = NULL; }
+
+	// The branches of 'if' are code, and a constant condition picks one
+	if (f && f->builtin == builtin_if) {
+		if (x->count != 4 || x->cell[2]->type != LVAL_QEXPR
+			|| x->cell[3]->type != LVAL_QEXPR) { return NULL; }
+		lfold_cell(e, formals, x, 1);
+		lfold_keep(e, formals, x->cell[2]);
+		lfold_keep(e, formals, x->cell[3]);
+		lval* c = lfold_value(x->cell[1]);
+		if (c == NULL || c->type != LVAL_LONG) { return NULL; }
+
+		lval* r = lval_copy(x->cell[c->data.num ? 2 : 3]);
+		if (r->type == LVAL_ERR) { lval_del(r); return NULL; }
+		lval_retype(r, LVAL_SEXPR);
+		return r;
+	}
+
+	int constant = 1;
+	for (int i = 0; i < x->count; i++) {
+		lfold_cell(e, formals, x, i);
+		if (i > 0 && !lfold_value(x->cell[i])) { constant = 0; }
+	}
+	if (!f || !f->pure || !constant || lmem_exhausted()) { return NULL; }
+	if (f->builtin == builtin_pow && x->count != 3) { return NULL; }
+	if (f->builtin == builtin_pow && lfold_value(x->cell[2])->type == LVAL_LONG &&
+		labs(lfold_value(x->cell[2])->data.num) > LFOLD_MAX_POWER) { return NULL; }
+
+	// Errors are left to be raised when the call runs
+	lval* a = lval_sexpr();
+	for (int i = 1; i < x->count; i++) { lval_add(a, lval_copy(lfold_value(x->cell[i]))); }
+	lval* r = f->builtin(e, a);
+	if (lfold_const(r)) { return r; }
+	lval_del(r);
+	return NULL;
+}
+
+void lval_fold(lenv* e, lval* formals, lval* body) {
+	lfold_keep(e, formals, body);
+}
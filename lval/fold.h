@@ -0,0 +1,39 @@
+#ifndef LVAL_FOLD
+#define LVAL_FOLD
+#include "base.h"
+
+/*
+    Constant folding
+    Run over the body of a lambda as it is created in e. Calls to pure
+    builtins on longs and doubles fold to their value when that is a
+    long or a double too, and 'if' on a constant condition to the branch
+    it takes. Powers are only worked out for exponents up to
+    LFOLD_MAX_POWER, past which they cost more than folding saves. A
+    head counts as a builtin when it is bound to one in e and is not a
+    formal.
+    Folded code is kept as it was, with what it folds to as its
+    expansion, which runs in its place for as long as the heads it was
+    folded through keep their builtins. Rebinding a name bound to a pure
+    builtin or 'if' starts a new fold epoch and records it for the name.
+    Code folded in an earlier epoch is checked against the names of its
+    heads once, and then runs as written if any of them was rebound.
+*/
+#define LFOLD_MAX_POWER 64
+
+// Epochs count rebinds in all sessions, on the one thread they run on
+extern int lfold_epoch;
+
+// Whether list x has been folded and still holds
+#define LFOLD_HOLDS(x) ((x)->expansion && (x)->macro == 0 && \
+	((x)->fold == lfold_epoch || lfold_renew(x)))
+
+// Whether folded list x still holds in the current epoch, moving it
+// there if so
+int lfold_renew(lval* x);
+
+// Called before k is bound anew where e finds it
+void lfold_rebind(lenv* e, lval* k);
+
+void lval_fold(lenv* e, lval* formals, lval* body);
+
+#endif
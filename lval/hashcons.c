@@ -0,0 +1,174 @@
+#include <string.h>
+#include <math.h>
+#include "hashcons.h"
+#include "environment.h"
+#include "numbers.h"
+#include "operations.h"
+#include "error.h"
+#include "memory.h"
+#include "bignum.h"
+
+int lhcons_enabled = 0;
+
+// Open addressing table of shared nodes, by structural hash
+static lval** lhcons_table = NULL;
+static long lhcons_size = 0;
+static long lhcons_count = 0;
+
+static unsigned long lhcons_mix(unsigned long h, unsigned long x) {
+	// FNV-1a over whole words
+	h ^= x;
+	h *= 1099511628211UL;
+	return h;
+}
+
+unsigned long lval_hash(lval* v) {
+	// Shared nodes keep their hash, symbols have the hash of their name
+	if (v->refs && v->type != LVAL_SYM) { return v->hash; }
+
+	unsigned long h = lhcons_mix(14695981039346656037UL, v->type);
+	switch (v->type) {
+		case LVAL_LONG: return lhcons_mix(h, (unsigned long) v->data.num);
+		case LVAL_DOUBLE: {
+			// 0.0 and -0.0 are equal
+			double d = v->data.dec == 0 ? 0 : v->data.dec;
+			unsigned long x;
+			memcpy(&x, &d, sizeof(x));
+			return lhcons_mix(h, x);
+		}
+		case LVAL_BIGINT:
+			h = lhcons_mix(h, (unsigned long) v->data.big->sign);
+			for (int i = 0; i < v->data.big->count; i++) {
+				h = lhcons_mix(h, v->data.big->limb[i]);
+			}
+			return h;
+		case LVAL_SYM: return lhcons_mix(h, v->hash);
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+			for (int i = 0; i < v->count; i++) { h = lhcons_mix(h, lval_hash(v->cell[i])); }
+			return h;
+		case LVAL_ERR: return lhcons_mix(h, lenv_hash(v->data.err));
+	}
+
+	// Functions hash by type alone
+	return h;
+}
+
+// Whether v can be shared once its elements are
+static int lhcons_shareable(lval* v) {
+	switch (v->type) {
+		case LVAL_LONG: case LVAL_BIGINT: case LVAL_SYM: return 1;
+		case LVAL_DOUBLE: return !isnan(v->data.dec);
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+			for (int i = 0; i < v->count; i++) {
+				if (v->cell[i]->refs == 0) { return 0; }
+			}
+			return 1;
+	}
+	return 0;
+}
+
+// Whether x and y hold the same thing, where their elements are shared
+// nodes already. Symbols keep their lexical address
+static int lhcons_same(lval* x, lval* y) {
+	if (x->type != y->type) { return 0; }
+	switch (x->type) {
+		case LVAL_LONG: return x->data.num == y->data.num;
+		case LVAL_DOUBLE: return memcmp(&x->data.dec, &y->data.dec, sizeof(double)) == 0;
+		case LVAL_BIGINT: return lbig_cmp(x->data.big, y->data.big) == 0;
+		case LVAL_SYM:
+			return strcmp(x->data.sym, y->data.sym) == 0 && x->depth == y->depth &&
+				x->slot == y->slot && x->cache == y->cache;
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+			if (x->count != y->count) { return 0; }
+			for (int i = 0; i < x->count; i++) {
+				if (x->cell[i] != y->cell[i]) { return 0; }
+			}
+			return 1;
+	}
+	return 0;
+}
+
+static void lhcons_insert(lval* v, unsigned long h) {
+	unsigned long mask = lhcons_size - 1;
+	unsigned long i = h & mask;
+	while (lhcons_table[i]) { i = (i + 1) & mask; }
+	lhcons_table[i] = v;
+	lhcons_count++;
+}
+
+static void lhcons_grow(void) {
+	if ((lhcons_count + 1) * 2 <= lhcons_size) { return; }
+
+	lval** old = lhcons_table;
+	long size = lhcons_size;
+	lhcons_size = size ? size * 2 : 256;
+	lhcons_table = (lval**) lmem_xalloc(LMEM_ENV, sizeof(lval*) * lhcons_size);
+	memset(lhcons_table, 0, sizeof(lval*) * lhcons_size);
+	lhcons_count = 0;
+	for (long i = 0; i < size; i++) {
+		if (old[i]) { lhcons_insert(old[i], lval_hash(old[i])); }
+	}
+	lmem_free(old);
+}
+
+lval* lval_intern(lval* v) {
+	if (v->refs) { v->refs++; return v; }
+
+	// Elements first, so a list is shared when all of them are
+	if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+		for (int i = 0; i < v->count; i++) { v->cell[i] = lval_intern(v->cell[i]); }
+	}
+	if (!lhcons_shareable(v)) { return v; }
+
+	unsigned long h = lval_hash(v);
+	if (lhcons_size) {
+		unsigned long mask = lhcons_size - 1;
+		for (unsigned long i = h & mask; lhcons_table[i]; i = (i + 1) & mask) {
+			lval* w = lhcons_table[i];
+			if (lval_hash(w) == h && lhcons_same(w, v)) {
+				lval_del(v);
+				w->refs++;
+				return w;
+			}
+		}
+	}
+
+	lhcons_grow();
+	if (v->type != LVAL_SYM) { v->hash = h; }
+	v->refs = 1;
+	lhcons_insert(v, h);
+	return v;
+}
+
+void lval_unintern(lval* v) {
+	unsigned long mask = lhcons_size - 1;
+	unsigned long i = lval_hash(v) & mask;
+	while (lhcons_table[i] != v) { i = (i + 1) & mask; }
+	lhcons_table[i] = NULL;
+	lhcons_count--;
+
+	// Move later entries of the run back into the gap
+	for (unsigned long j = (i + 1) & mask; lhcons_table[j]; j = (j + 1) & mask) {
+		lval* w = lhcons_table[j];
+		unsigned long k = lval_hash(w) & mask;
+		if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+			lhcons_table[i] = w;
+			lhcons_table[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+lval* builtin_hashcons(lenv* e, lval* a) {
+	LASSERT_NUM("hashcons", a, 1)
+	LASSERT_TYPE("hashcons", a, 0, LVAL_LONG)
+
+	// Hand back the previous setting
+	lval* x = lval_long(lhcons_enabled);
+	lhcons_enabled = a->cell[0]->data.num != 0;
+	lval_del(a);
+	return x;
+}
@@ -0,0 +1,29 @@
+#ifndef LVAL_HASHCONS
+#define LVAL_HASHCONS
+#include "base.h"
+
+/*
+    Hash-consing
+    Values bound in an environment are never changed in place, only
+    copied out. When hash-consing is on they are stored through a table
+    of shared nodes instead, so equal subtrees are kept once however
+    often they appear. A shared node counts its holders in refs and
+    keeps its structural hash, so two of them are equal when they are
+    the same node and unequal when their hashes differ.
+    Functions, errors and NaN are never shared, nor are the lists that
+    hold them.
+*/
+extern int lhcons_enabled;
+
+// Structural hash: values that lval_eq finds equal hash the same
+unsigned long lval_hash(lval* v);
+
+// Takes v, giving the shared node for it where it can be shared
+lval* lval_intern(lval* v);
+
+// Forget a shared node whose last holder has gone
+void lval_unintern(lval* v);
+
+lval* builtin_hashcons(lenv* e, lval* a);
+
+#endif
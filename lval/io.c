@@ -1,10 +1,16 @@
 #include <stdio.h>
 #include "environment.h"
 #include "io.h"
+#include "bignum.h"
+#include "lazy.h"
 
 void flval_expr_print(FILE* stream, lval* v, char open, char close) {
+	flval_cells_print(stream, v, 0, open, close);
+}
+
+void flval_cells_print(FILE* stream, lval* v, int from, char open, char close) {
 	putchar(open);
-	for (int i = 0; i < v->count; i++) {
+	for (int i = from; i < v->count; i++) {
 		// Print value contained within
 		flval_print(stream, v->cell[i]);
 
@@ -23,6 +29,16 @@ void flval_print(FILE* stream, lval* v) {
 		
 		case LVAL_DOUBLE: fprintf(stream, "%lf", v->data.dec); break;
 
+		case LVAL_BIGINT: lbig_print(stream, v->data.big); break;
+
+		// Forced delays show their value
+		case LVAL_THUNK:
+			if (v->data.thunk->value) {
+				flval_print(stream, v->data.thunk->value);
+			} else {
+				fprintf(stream, "<delay>");
+			} break;
+
 		case LVAL_ERR: fprintf(stream, "Error: %s", v->data.err); break;
 
 		case LVAL_SYM: fprintf(stream, "%s", v->data.sym); break;
@@ -32,11 +48,14 @@ void flval_print(FILE* stream, lval* v) {
 		case LVAL_QEXPR: flval_expr_print(stream, v, '{', '}'); break;
 
 		case LVAL_FUN: 
-			if (v->builtin) {
+			if (v->fun->builtin) {
 				fprintf(stream, "<function>");
+			} else if (v->fun->macro) {
+				fprintf(stream, "<macro>");
 			} else {
-				fprintf(stream, "(\\ "); flval_print(stream, v->formals);
-				fprintf(stream, " "); flval_print(stream, v->body); fprintf(stream, ")");
+				// Partial applications show the formals left to bind
+				fprintf(stream, "(\\ "); flval_cells_print(stream, v->fun->params->syms, v->fun->bound, '{', '}');
+				fprintf(stream, " "); flval_print(stream, lval_body(v)); fprintf(stream, ")");
 			} break;
 	}
 }
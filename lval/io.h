@@ -4,6 +4,8 @@
 #include "base.h"
 
 void flval_expr_print(FILE* stream, lval* v, char open, char close);
+// Same for the elements of v from the given position on
+void flval_cells_print(FILE* stream, lval* v, int from, char open, char close);
 void flval_print(FILE* stream, lval* v);
 void lval_print(lval* v);
 void lval_println(lval* v);
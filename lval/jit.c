@@ -0,0 +1,494 @@
+#define _DEFAULT_SOURCE
+#include <string.h>
+#include <stdint.h>
+#if defined(__x86_64__) && !defined(_WIN32)
+#define LJIT_NATIVE
+#include <sys/mman.h>
+#endif
+#include "jit.h"
+#include "vm.h"
+#include "environment.h"
+#include "expressions.h"
+#include "numbers.h"
+#include "conditionals.h"
+#include "operations.h"
+#include "error.h"
+#include "memory.h"
+#include "fold.h"
+
+int ljit_enabled = 1;
+ljit_stats ljit_totals;
+
+void ljit_free(ljit* j) {
+	if (j == NULL) { return; }
+#ifdef LJIT_NATIVE
+	munmap(j->code, j->size);
+#endif
+	lmem_free(j->heads);
+	lmem_free(j->builtins);
+	lmem_free(j->folds);
+	lmem_free(j);
+}
+
+#ifdef LJIT_NATIVE
+
+/*
+    Native code keeps every value on the machine stack as a long. A body
+    is entered with its arguments pushed in order below the return
+    address, and leaves its result in rax. r12 counts down the calls the
+    recursion limit still allows and r13 holds the lowest the stack may
+    go. Giving up jumps to a stub that unwinds the whole run at once.
+*/
+static uintptr_t ljit_sp;
+static int ljit_bailed;
+
+typedef long (*ljit_entry)(long* args, long depth, uintptr_t floor);
+
+// Compiler state: the code being built and where its parts are
+typedef struct ljit_compiler {
+	lval* f;
+	ljit* j;
+	uint8_t* buf;
+	int count;
+	int capacity;
+	int bail;
+	int body;
+	int start;
+} ljit_compiler;
+
+static void ljit_byte(ljit_compiler* k, uint8_t x) {
+	if (k->count == k->capacity) {
+		k->capacity = k->capacity ? k->capacity * 2 : 256;
+		k->buf = (uint8_t*) lmem_xrealloc(LVAL_FUN, k->buf, k->capacity);
+	}
+	k->buf[k->count++] = x;
+}
+
+static void ljit_bytes(ljit_compiler* k, int n, const uint8_t* x) {
+	for (int i = 0; i < n; i++) { ljit_byte(k, x[i]); }
+}
+
+static void ljit_u32(ljit_compiler* k, uint32_t x) {
+	for (int i = 0; i < 4; i++) { ljit_byte(k, x >> (8 * i)); }
+}
+
+static void ljit_u64(ljit_compiler* k, uint64_t x) {
+	for (int i = 0; i < 8; i++) { ljit_byte(k, x >> (8 * i)); }
+}
+
+#define LJIT(k, ...) do { \
+	static const uint8_t ljit_code_[] = { __VA_ARGS__ }; \
+	ljit_bytes(k, sizeof(ljit_code_), ljit_code_); \
+} while (0)
+
+// Point the rel32 at position at to target
+static void ljit_patch(ljit_compiler* k, int at, int target) {
+	uint32_t rel = (uint32_t) (target - (at + 4));
+	for (int i = 0; i < 4; i++) { k->buf[at + i] = rel >> (8 * i); }
+}
+
+// Emit a jump or call to target, returning where its offset went
+static int ljit_jump(ljit_compiler* k, int target) {
+	int at = k->count;
+	ljit_u32(k, 0);
+	if (target >= 0) { ljit_patch(k, at, target); }
+	return at;
+}
+
+#define LJIT_JMP(k, t) (ljit_byte(k, 0xE9), ljit_jump(k, t))
+#define LJIT_CALL(k, t) (ljit_byte(k, 0xE8), ljit_jump(k, t))
+#define LJIT_JCC(k, cc, t) (ljit_byte(k, 0x0F), ljit_byte(k, 0x80 | (cc)), ljit_jump(k, t))
+
+// Condition codes
+enum { LJIT_O = 0x0, LJIT_B = 0x2, LJIT_E = 0x4, LJIT_NE = 0x5,
+	LJIT_L = 0xC, LJIT_GE = 0xD, LJIT_LE = 0xE, LJIT_G = 0xF };
+
+static int ljit_formal_index(lval* formals, char* sym) {
+	for (int i = 0; i < formals->count; i++) {
+		if (strcmp(formals->cell[i]->data.sym, sym) == 0) { return i; }
+	}
+	return -1;
+}
+
+// Position of formal i above the frame pointer
+static uint32_t ljit_formal(ljit_compiler* k, int i) {
+	return 16 + 8 * (k->j->formals - 1 - i);
+}
+
+static int ljit_sexpr(ljit_compiler* k, lval* x, int tail);
+
+// Code pushing the value of x
+static int ljit_expr(ljit_compiler* k, lval* x) {
+	switch (x->type) {
+		case LVAL_LONG:
+			if (x->data.num >= INT32_MIN && x->data.num <= INT32_MAX) {
+				// push imm32
+				ljit_byte(k, 0x68);
+				ljit_u32(k, (uint32_t) x->data.num);
+			} else {
+				// mov rax, imm64; push rax
+				LJIT(k, 0x48, 0xB8);
+				ljit_u64(k, (uint64_t) x->data.num);
+				LJIT(k, 0x50);
+			}
+			return 1;
+
+		case LVAL_SYM: {
+			int i = ljit_formal_index(k->f->fun->params->syms, x->data.sym);
+			if (i == -1) { return 0; }
+			// push [rbp + formal]
+			LJIT(k, 0xFF, 0xB5);
+			ljit_u32(k, ljit_formal(k, i));
+			return 1;
+		}
+
+		case LVAL_SEXPR: return ljit_sexpr(k, x, 0);
+		default: return 0;
+	}
+}
+
+// Pop the result and return from the body
+static void ljit_return(ljit_compiler* k) {
+	// pop rax; add r12, 1; leave; ret
+	LJIT(k, 0x58, 0x49, 0x83, 0xC4, 0x01, 0xC9, 0xC3);
+}
+
+// Fold the arguments of an arithmetic builtin, as lnum_fold does
+static int ljit_arith(ljit_compiler* k, lval* x, lbuiltin b) {
+	if (!ljit_expr(k, x->cell[1])) { return 0; }
+	if (x->count == 2 && b == builtin_sub) {
+		// pop rax; neg rax; jo bail; push rax
+		LJIT(k, 0x58, 0x48, 0xF7, 0xD8);
+		LJIT_JCC(k, LJIT_O, k->bail);
+		LJIT(k, 0x50);
+	}
+
+	for (int i = 2; i < x->count; i++) {
+		if (!ljit_expr(k, x->cell[i])) { return 0; }
+		// pop rcx; pop rax
+		LJIT(k, 0x59, 0x58);
+		if (b == builtin_add) {
+			LJIT(k, 0x48, 0x01, 0xC8);
+			LJIT_JCC(k, LJIT_O, k->bail);
+		} else if (b == builtin_sub) {
+			LJIT(k, 0x48, 0x29, 0xC8);
+			LJIT_JCC(k, LJIT_O, k->bail);
+		} else if (b == builtin_mul) {
+			LJIT(k, 0x48, 0x0F, 0xAF, 0xC1);
+			LJIT_JCC(k, LJIT_O, k->bail);
+		} else if (b == builtin_min) {
+			// cmp rax, rcx; cmovg rax, rcx
+			LJIT(k, 0x48, 0x39, 0xC8, 0x48, 0x0F, 0x4F, 0xC1);
+		} else if (b == builtin_max) {
+			// cmp rax, rcx; cmovl rax, rcx
+			LJIT(k, 0x48, 0x39, 0xC8, 0x48, 0x0F, 0x4C, 0xC1);
+		} else {
+			// Dividing by zero is an error, and by -1 may overflow
+			// test rcx, rcx; jz bail; cmp rcx, -1; jne divide
+			LJIT(k, 0x48, 0x85, 0xC9);
+			LJIT_JCC(k, LJIT_E, k->bail);
+			LJIT(k, 0x48, 0x83, 0xF9, 0xFF);
+			int divide = LJIT_JCC(k, LJIT_NE, -1);
+			if (b == builtin_div) {
+				// neg rax; jo bail
+				LJIT(k, 0x48, 0xF7, 0xD8);
+				LJIT_JCC(k, LJIT_O, k->bail);
+			} else {
+				// xor eax, eax
+				LJIT(k, 0x31, 0xC0);
+			}
+			int done = LJIT_JMP(k, -1);
+			ljit_patch(k, divide, k->count);
+			// cqo; idiv rcx
+			LJIT(k, 0x48, 0x99, 0x48, 0xF7, 0xF9);
+			// mov rax, rdx for the remainder
+			if (b == builtin_mod) { LJIT(k, 0x48, 0x89, 0xD0); }
+			ljit_patch(k, done, k->count);
+		}
+		// push rax
+		LJIT(k, 0x50);
+	}
+	return 1;
+}
+
+static int ljit_compare(ljit_compiler* k, lval* x, lbuiltin b) {
+	if (x->count != 3) { return 0; }
+	if (!ljit_expr(k, x->cell[1]) || !ljit_expr(k, x->cell[2])) { return 0; }
+
+	int cc = b == builtin_lt ? LJIT_L : b == builtin_gt ? LJIT_G
+		: b == builtin_le ? LJIT_LE : b == builtin_ge ? LJIT_GE
+		: b == builtin_eq ? LJIT_E : LJIT_NE;
+
+	// pop rcx; pop rax; cmp rax, rcx; setcc al; movzx eax, al; push rax
+	LJIT(k, 0x59, 0x58, 0x48, 0x39, 0xC8);
+	LJIT(k, 0x0F);
+	ljit_byte(k, 0x90 | cc);
+	LJIT(k, 0xC0, 0x0F, 0xB6, 0xC0, 0x50);
+	return 1;
+}
+
+static int ljit_if(ljit_compiler* k, lval* x, int tail) {
+	if (x->count != 4 || x->cell[2]->type != LVAL_QEXPR || x->cell[3]->type != LVAL_QEXPR) {
+		return 0;
+	}
+	if (!ljit_expr(k, x->cell[1])) { return 0; }
+
+	// pop rax; test rax, rax; jz other
+	LJIT(k, 0x58, 0x48, 0x85, 0xC0);
+	int other = LJIT_JCC(k, LJIT_E, -1);
+	if (!ljit_sexpr(k, x->cell[2], tail)) { return 0; }
+	int done = tail ? -1 : LJIT_JMP(k, -1);
+	ljit_patch(k, other, k->count);
+	if (!ljit_sexpr(k, x->cell[3], tail)) { return 0; }
+	if (done >= 0) { ljit_patch(k, done, k->count); }
+	return 1;
+}
+
+// A call of the function itself, which replaces the running call in tail position
+static int ljit_self(ljit_compiler* k, lval* x, int tail) {
+	int n = k->j->formals;
+	if (x->count - 1 != n) { return 0; }
+	for (int i = 1; i < x->count; i++) {
+		if (!ljit_expr(k, x->cell[i])) { return 0; }
+	}
+
+	if (tail) {
+		for (int i = n - 1; i >= 0; i--) {
+			// pop rax; mov [rbp + formal], rax
+			LJIT(k, 0x58, 0x48, 0x89, 0x85);
+			ljit_u32(k, ljit_formal(k, i));
+		}
+		LJIT_JMP(k, k->start);
+		return 1;
+	}
+
+	// call body; add rsp, 8n; push rax
+	LJIT_CALL(k, k->body);
+	LJIT(k, 0x48, 0x81, 0xC4);
+	ljit_u32(k, 8 * n);
+	LJIT(k, 0x50);
+	return 1;
+}
+
+// Remember what the head of a call has to stay bound to
+static void ljit_guard(ljit* j, lval* head, lbuiltin b) {
+	j->heads = (lval**) lmem_xrealloc(LVAL_FUN, j->heads, sizeof(lval*) * (j->nheads + 1));
+	j->builtins = (lbuiltin*) lmem_xrealloc(LVAL_FUN, j->builtins, sizeof(lbuiltin) * (j->nheads + 1));
+	j->heads[j->nheads] = head;
+	j->builtins[j->nheads] = b;
+	j->nheads++;
+}
+
+// Code for x run as an S-Expression, pushing its value, or returning it
+// from the body in tail position
+static int ljit_sexpr(ljit_compiler* k, lval* x, int tail) {
+	// Empty and single symbol expressions do not give numbers
+	if (x->count == 0 || (x->count == 1 && x->cell[0]->type == LVAL_SYM)) { return 0; }
+
+	// Folded code is built as folded, valid as long as the fold holds
+	if (LFOLD_HOLDS(x)) {
+		ljit* j = k->j;
+		j->folds = (lval**) lmem_xrealloc(LVAL_FUN, j->folds, sizeof(lval*) * (j->nfolds + 1));
+		j->folds[j->nfolds++] = x;
+		if (x->expansion->type == LVAL_SEXPR) { return ljit_sexpr(k, x->expansion, tail); }
+		if (!ljit_expr(k, x->expansion)) { return 0; }
+		if (tail) { ljit_return(k); }
+		return 1;
+	}
+
+	lval* head = x->cell[0];
+	if (x->count == 1) {
+		if (!ljit_expr(k, head)) { return 0; }
+		if (tail) { ljit_return(k); }
+		return 1;
+	}
+
+	if (head->type != LVAL_SYM) { return 0; }
+	lval* x0 = NULL;
+	if (ljit_formal_index(k->f->fun->params->syms, head->data.sym) == -1) { x0 = lenv_lookup(k->f->fun->env, head); }
+	if (x0 == NULL || x0->type != LVAL_FUN) { return 0; }
+
+	lbuiltin b = x0->fun->builtin;
+	if (b == NULL) {
+		// A memoized copy shares the code but not what calling it does
+		if (x0->fun->code != k->f->fun->code || x0->fun->memo) { return 0; }
+		ljit_guard(k->j, head, NULL);
+		return ljit_self(k, x, tail);
+	}
+	ljit_guard(k->j, head, b);
+
+	int ok;
+	if (b == builtin_if) {
+		return ljit_if(k, x, tail);
+	} else if (b == builtin_add || b == builtin_sub || b == builtin_mul || b == builtin_div ||
+		b == builtin_mod || b == builtin_min || b == builtin_max) {
+		ok = ljit_arith(k, x, b);
+	} else if (b == builtin_lt || b == builtin_gt || b == builtin_le || b == builtin_ge ||
+		b == builtin_eq || b == builtin_ne) {
+		ok = ljit_compare(k, x, b);
+	} else {
+		return 0;
+	}
+	if (ok && tail) { ljit_return(k); }
+	return ok;
+}
+
+static ljit* ljit_compile(lval* f) {
+	int n = f->fun->params->syms->count;
+	if (n > LJIT_MAX_ARGS || f->fun->params->rest != -1) { return NULL; }
+
+	ljit* j = (ljit*) lmem_xalloc(LVAL_FUN, sizeof(ljit));
+	memset(j, 0, sizeof(ljit));
+	j->formals = n;
+	ljit_compiler k = { f, j, NULL, 0, 0, 0, 0, 0 };
+
+	// Entry from C: save the registers used and where to unwind to, then
+	// push the arguments and call the body
+	// push rbp; push r12; push r13; mov r12, rsi; mov r13, rdx
+	LJIT(&k, 0x55, 0x41, 0x54, 0x41, 0x55, 0x49, 0x89, 0xF4, 0x49, 0x89, 0xD5);
+	// mov rax, &ljit_sp; mov [rax], rsp
+	LJIT(&k, 0x48, 0xB8);
+	ljit_u64(&k, (uint64_t) (uintptr_t) &ljit_sp);
+	LJIT(&k, 0x48, 0x89, 0x20);
+	for (int i = 0; i < n; i++) {
+		// push [rdi + 8i]
+		LJIT(&k, 0xFF, 0xB7);
+		ljit_u32(&k, 8 * i);
+	}
+	int call = LJIT_CALL(&k, -1);
+	// add rsp, 8n; pop r13; pop r12; pop rbp; ret
+	LJIT(&k, 0x48, 0x81, 0xC4);
+	ljit_u32(&k, 8 * n);
+	LJIT(&k, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0xC3);
+
+	// Giving up: mov rax, &ljit_sp; mov rsp, [rax]; mov rax, &ljit_bailed;
+	// mov dword [rax], 1; pop r13; pop r12; pop rbp; ret
+	k.bail = k.count;
+	LJIT(&k, 0x48, 0xB8);
+	ljit_u64(&k, (uint64_t) (uintptr_t) &ljit_sp);
+	LJIT(&k, 0x48, 0x8B, 0x20, 0x48, 0xB8);
+	ljit_u64(&k, (uint64_t) (uintptr_t) &ljit_bailed);
+	LJIT(&k, 0xC7, 0x00, 0x01, 0x00, 0x00, 0x00);
+	LJIT(&k, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0xC3);
+
+	// The body: push rbp; mov rbp, rsp; sub r12, 1; jl bail; cmp rsp, r13; jb bail
+	k.body = k.count;
+	ljit_patch(&k, call, k.body);
+	LJIT(&k, 0x55, 0x48, 0x89, 0xE5, 0x49, 0x83, 0xEC, 0x01);
+	LJIT_JCC(&k, LJIT_L, k.bail);
+	LJIT(&k, 0x4C, 0x39, 0xEC);
+	LJIT_JCC(&k, LJIT_B, k.bail);
+	k.start = k.count;
+
+	if (!ljit_sexpr(&k, lval_body(f), 1)) {
+		lmem_free(k.buf);
+		ljit_free(j);
+		return NULL;
+	}
+
+	// Copy the code into memory that can run but no longer be written
+	j->size = k.count;
+	j->code = mmap(NULL, j->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (j->code == MAP_FAILED) {
+		j->code = NULL;
+		lmem_free(k.buf);
+		lmem_free(j->heads);
+		lmem_free(j->builtins);
+		lmem_free(j->folds);
+		lmem_free(j);
+		return NULL;
+	}
+	memcpy(j->code, k.buf, k.count);
+	lmem_free(k.buf);
+	mprotect(j->code, j->size, PROT_READ | PROT_EXEC);
+	return j;
+}
+
+// Whether the heads of calls in the body are still bound as they were
+static int ljit_valid(ljit* j, lval* f) {
+	for (int i = 0; i < j->nfolds; i++) {
+		if (!LFOLD_HOLDS(j->folds[i])) { return 0; }
+	}
+	for (int i = 0; i < j->nheads; i++) {
+		lval* x = lenv_lookup(f->fun->env, j->heads[i]);
+		if (x == NULL || x->type != LVAL_FUN || x->fun->builtin != j->builtins[i]) { return 0; }
+		if (x->fun->builtin == NULL && (x->fun->code != f->fun->code || x->fun->memo)) { return 0; }
+	}
+	return 1;
+}
+
+int ljit_call(lval* f, lval** args, int n, lval** r) {
+	// Closures from partial application share the code with formals bound
+	lcode* c = f->fun->code;
+	if (!ljit_enabled || c->calls < 0 || f->fun->bound) { return 0; }
+	if (c->jit == NULL) {
+		if (++c->calls < LJIT_HOT) { return 0; }
+		c->jit = ljit_compile(f);
+		if (c->jit == NULL) {
+			// Never try again
+			c->calls = -1;
+			ljit_totals.rejected++;
+			return 0;
+		}
+		ljit_totals.compiled++;
+	}
+
+	ljit* j = c->jit;
+	if (n != j->formals) { return 0; }
+	long v[LJIT_MAX_ARGS];
+	for (int i = 0; i < n; i++) {
+		if (args[i]->type != LVAL_LONG) { return 0; }
+		v[i] = args[i]->data.num;
+	}
+	long stack = lmem_stack_left();
+	if (stack == 0 || lvm_depth >= lvm_max_depth || lmem_exhausted() || !ljit_valid(j, f)) { return 0; }
+
+	char here;
+	ljit_bailed = 0;
+	ljit_totals.runs++;
+	long x = ((ljit_entry) j->code)(v, lvm_max_depth - lvm_depth, (uintptr_t) &here - stack);
+	if (ljit_bailed) {
+		ljit_totals.bails++;
+		// Bodies that keep giving up stop being tried
+		if (++j->bails == LJIT_MAX_BAILS) { c->calls = -1; }
+		return 0;
+	}
+	*r = lval_long(x);
+	return 1;
+}
+
+#else
+
+int ljit_call(lval* f, lval** args, int n, lval** r) { return 0; }
+
+#endif
+
+lval* builtin_jit(lenv* e, lval* a) {
+	LASSERT_NUM("jit", a, 1)
+	LASSERT_TYPE("jit", a, 0, LVAL_LONG)
+
+	// Hand back the previous setting
+	lval* x = lval_long(ljit_enabled);
+	ljit_enabled = a->cell[0]->data.num != 0;
+	lval_del(a);
+	return x;
+}
+
+// Build an entry of the form {name value}
+static lval* ljit_stat(char* name, long x) {
+	lval* v = lval_add(lval_qexpr(), lval_sym(name));
+	return lval_add(v, lval_long(x));
+}
+
+lval* builtin_jit_stats(lenv* e, lval* a) {
+	LASSERT_NUM("jit-stats", a, 0)
+
+	lval* x = lval_qexpr();
+	x = lval_add(x, ljit_stat("enabled", ljit_enabled));
+	x = lval_add(x, ljit_stat("compiled", ljit_totals.compiled));
+	x = lval_add(x, ljit_stat("rejected", ljit_totals.rejected));
+	x = lval_add(x, ljit_stat("runs", ljit_totals.runs));
+	x = lval_add(x, ljit_stat("bails", ljit_totals.bails));
+	lval_del(a);
+	return x;
+}
@@ -0,0 +1,62 @@
+#ifndef LVAL_JIT
+#define LVAL_JIT
+#include "base.h"
+
+/*
+    Native code for hot integer lambdas
+    Once a compiled body has been called LJIT_HOT times it is translated
+    to x86-64, provided it only uses its formals, integer constants, the
+    arithmetic and comparison builtins, 'if' and calls to itself. The
+    native code works on longs in place of lvals and gives up on anything
+    else the builtins would do: an overflow, a division by zero, going
+    past the recursion limit or the C stack. Nothing it does can be seen
+    from outside, so giving up simply leaves the call to the machine.
+*/
+#define LJIT_HOT 100
+
+// Formals a native body can take
+#define LJIT_MAX_ARGS 8
+
+// A body that gives up this often is left to the machine
+#define LJIT_MAX_BAILS 64
+
+struct ljit {
+    // Executable code and its size
+    void* code;
+    long size;
+    int formals;
+
+    // Heads of calls in the body and the builtins they were bound to,
+    // or NULL for the function itself. Checked before each run
+    lval** heads;
+    lbuiltin* builtins;
+    int nheads;
+    // Folded calls it was built from as folded
+    lval** folds;
+    int nfolds;
+
+    long bails;
+};
+
+// Whether hot bodies are compiled and run natively
+extern int ljit_enabled;
+
+typedef struct ljit_stats {
+    long compiled;
+    long rejected;
+    long runs;
+    long bails;
+} ljit_stats;
+
+extern ljit_stats ljit_totals;
+
+// Run the call of lambda f on n arguments natively, if it is hot and
+// can be. Returns whether it did, with the result in r
+int ljit_call(lval* f, lval** args, int n, lval** r);
+
+void ljit_free(ljit* j);
+
+lval* builtin_jit(lenv* e, lval* a);
+lval* builtin_jit_stats(lenv* e, lval* a);
+
+#endif
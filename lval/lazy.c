@@ -0,0 +1,119 @@
+#include "lazy.h"
+#include "environment.h"
+#include "expressions.h"
+#include "operations.h"
+#include "error.h"
+#include "memory.h"
+
+lval* lval_thunk(lenv* e, lval* expr) {
+	lthunk* t = (lthunk*) lmem_xalloc(LVAL_THUNK, sizeof(lthunk));
+	t->refs = 1;
+	t->env = lenv_retain(e);
+	t->expr = expr;
+	t->value = NULL;
+	t->forcing = 0;
+
+	lval* v = lval_alloc(LVAL_THUNK);
+	v->data.thunk = t;
+	return v;
+}
+
+lval* lval_force(lval* v) {
+	while (v->type == LVAL_THUNK) {
+		lthunk* t = v->data.thunk;
+		if (t->value == NULL) {
+			if (t->forcing) {
+				lval_del(v);
+				return lval_err("Function 'force' passed a delay that needs its own value.");
+			}
+
+			// The expression runs as 'eval' would run it
+			t->forcing = 1;
+			lval* r = lval_run(t->env, t->expr, 0);
+			t->forcing = 0;
+			if (r->type == LVAL_ERR) { lval_del(v); return r; }
+
+			t->value = r;
+			lval_del(t->expr);
+			t->expr = NULL;
+			lenv_release(t->env);
+			t->env = NULL;
+		}
+		lval* x = lval_copy(t->value);
+		lval_del(v);
+		v = x;
+	}
+	return v;
+}
+
+lval* builtin_delay(lenv* e, lval* a) {
+	LASSERT_NUM("delay", a, 1)
+	LASSERT_TYPE("delay", a, 0, LVAL_QEXPR)
+	return lval_thunk(e, lval_take(a, 0));
+}
+
+lval* builtin_force(lenv* e, lval* a) {
+	LASSERT_NUM("force", a, 1)
+	return lval_force(lval_take(a, 0));
+}
+
+lval* builtin_lazy_cons(lenv* e, lval* a) {
+	LASSERT_NUM("lazy-cons", a, 2)
+	LASSERT_TYPE("lazy-cons", a, 1, LVAL_QEXPR)
+
+	lval* x = lval_add(lval_qexpr(), lval_pop(a, 0));
+	return lval_add(x, lval_thunk(e, lval_take(a, 0)));
+}
+
+lval* builtin_lazy_head(lenv* e, lval* a) {
+	LASSERT_NUM("lazy-head", a, 1)
+	LASSERT_TYPE("lazy-head", a, 0, LVAL_QEXPR)
+	LASSERT_NOT_EMPTY("lazy-head", a, 0)
+	LASSERT(a, a->cell[0]->count == 2,
+		"Function 'lazy-head' passed a list of %i elements. Expected a lazy sequence.",
+		a->cell[0]->count)
+
+	return lval_take(lval_take(a, 0), 0);
+}
+
+lval* builtin_lazy_tail(lenv* e, lval* a) {
+	LASSERT_NUM("lazy-tail", a, 1)
+	LASSERT_TYPE("lazy-tail", a, 0, LVAL_QEXPR)
+	LASSERT_NOT_EMPTY("lazy-tail", a, 0)
+	LASSERT(a, a->cell[0]->count == 2,
+		"Function 'lazy-tail' passed a list of %i elements. Expected a lazy sequence.",
+		a->cell[0]->count)
+
+	return lval_force(lval_take(lval_take(a, 0), 1));
+}
+
+lval* builtin_take(lenv* e, lval* a) {
+	LASSERT_NUM("take", a, 2)
+	LASSERT_TYPE("take", a, 0, LVAL_LONG)
+	LASSERT(a, a->cell[0]->data.num >= 0,
+		"Function 'take' passed a negative count.")
+	LASSERT_TYPE("take", a, 1, LVAL_QEXPR)
+
+	long n = a->cell[0]->data.num;
+	lval* s = lval_take(a, 1);
+	lval* x = lval_qexpr();
+
+	// Only the tails up to the last element taken are forced, and the
+	// cells passed over are let go as it goes
+	for (long i = 0; i < n; i++) {
+		if (s->type == LVAL_ERR) { lval_del(x); return s; }
+		if (s->type == LVAL_QEXPR && s->count == 0) { break; }
+		if (s->type != LVAL_QEXPR || s->count != 2) {
+			lval* err = lval_err("Function 'take' reached a tail that is not a lazy sequence.");
+			lval_del(s);
+			lval_del(x);
+			return err;
+		}
+		x = lval_append(x, lval_pop(s, 0));
+		if (x->type == LVAL_ERR) { lval_del(s); return x; }
+		if (i + 1 == n) { break; }
+		s = lval_force(lval_take(s, 0));
+	}
+	lval_del(s);
+	return x;
+}
@@ -0,0 +1,41 @@
+#ifndef LVAL_LAZY
+#define LVAL_LAZY
+#include "base.h"
+
+/*
+    Delayed values
+    (delay {expr}) holds expr unevaluated along with the environment it
+    was written in. The first force evaluates it and keeps the value for
+    every later force, by this copy or any other, and lets go of the
+    expression and its environment. An error leaves it pending.
+    Lazy sequences are built from them: a cell is {head tail} where the
+    tail is a delayed sequence, and {} is the end.
+*/
+struct lthunk {
+    int refs;
+
+    // Pending: the expression and where it runs
+    lenv* env;
+    lval* expr;
+
+    // Forced: the value
+    lval* value;
+
+    // Being forced, so that forcing it again would never end
+    int forcing;
+};
+
+// Takes the Q-Expression expr, to be run in e
+lval* lval_thunk(lenv* e, lval* expr);
+
+// Takes v, giving its value once every delay around it is forced
+lval* lval_force(lval* v);
+
+lval* builtin_delay(lenv* e, lval* a);
+lval* builtin_force(lenv* e, lval* a);
+lval* builtin_lazy_cons(lenv* e, lval* a);
+lval* builtin_lazy_head(lenv* e, lval* a);
+lval* builtin_lazy_tail(lenv* e, lval* a);
+lval* builtin_take(lenv* e, lval* a);
+
+#endif
@@ -0,0 +1,195 @@
+#include <string.h>
+#include "loop.h"
+#include "environment.h"
+#include "expressions.h"
+#include "operations.h"
+#include "numbers.h"
+#include "vm.h"
+#include "error.h"
+#include "memory.h"
+
+long lloop_depth = -1;
+
+// The error for a test or count x of the wrong type, taking x
+static lval* lloop_type_err(char* func, char* what, lval* x) {
+	if (x->type == LVAL_ERR) { return x; }
+	lval* err = lval_err(
+		"Function '%s' passed incorrect type for its %s. "
+		"Got %s, Expected %s.",
+		func, what, ltype_name(x->type), ltype_name(LVAL_LONG));
+	lval_del(x);
+	return err;
+}
+
+// A frame for n loop variables over e
+static lenv* lloop_frame(lenv* e, int n) {
+	lenv* f = lenv_frame(e, n);
+	f->loop = 1;
+	return f;
+}
+
+lval* builtin_while(lenv* e, lval* a) {
+	LASSERT_NUM("while", a, 2)
+	LASSERT_TYPE("while", a, 0, LVAL_QEXPR)
+	LASSERT_TYPE("while", a, 1, LVAL_QEXPR)
+
+	lval* r = lval_sexpr();
+	while (1) {
+		lval* t = lval_run(e, a->cell[0], 0);
+		if (t->type != LVAL_LONG) {
+			lval_del(r);
+			r = lloop_type_err("while", "test", t);
+			break;
+		}
+		int done = t->data.num == 0;
+		lval_del(t);
+		if (done) { break; }
+
+		lval* x = lval_run(e, a->cell[1], 0);
+		if (x->type == LVAL_ERR) {
+			lval_del(r);
+			r = x;
+			break;
+		}
+		lval_del(x);
+	}
+	lval_del(a);
+	return r;
+}
+
+lval* builtin_dotimes(lenv* e, lval* a) {
+	LASSERT_NUM("dotimes", a, 2)
+	LASSERT_TYPE("dotimes", a, 0, LVAL_QEXPR)
+	LASSERT_TYPE("dotimes", a, 1, LVAL_QEXPR)
+	LASSERT(a, a->cell[0]->count == 2 && a->cell[0]->cell[0]->type == LVAL_SYM,
+		"Function 'dotimes' passed an invalid binding. Expected {symbol count}.")
+
+	lval* n = lval_eval(e, lval_copy(a->cell[0]->cell[1]));
+	if (n->type != LVAL_LONG) {
+		lval_del(a);
+		return lloop_type_err("dotimes", "count", n);
+	}
+	long count = n->data.num;
+	lval_del(n);
+
+	lenv* frame = NULL;
+	lval* r = lval_sexpr();
+	for (long i = 0; i < count; i++) {
+		// Closures made by the last run keep its frame as it was
+		if (frame && frame->refs > 1) {
+			lenv_pop(frame);
+			frame = NULL;
+		}
+
+		// The counter is set where it is, unless the body rebound it
+		if (frame == NULL) {
+			frame = lloop_frame(e, 1);
+			lenv_bind_formal(frame, a->cell[0]->cell[0], lval_long(i));
+		} else {
+			lval* v = frame->cells[0]->val;
+			if (v->type == LVAL_LONG && v->refs == 0) {
+				v->data.num = i;
+			} else {
+				lval_del(v);
+				frame->cells[0]->val = lval_long(i);
+			}
+		}
+
+		lval* x = lval_run(frame, a->cell[1], 0);
+		if (x->type == LVAL_ERR) {
+			lval_del(r);
+			r = x;
+			break;
+		}
+		lval_del(x);
+	}
+	if (frame) { lenv_pop(frame); }
+	lval_del(a);
+	return r;
+}
+
+lval* builtin_loop(lenv* e, lval* a) {
+	LASSERT_NUM("loop", a, 2)
+	LASSERT_TYPE("loop", a, 0, LVAL_QEXPR)
+	LASSERT_TYPE("loop", a, 1, LVAL_QEXPR)
+
+	lval* vars = a->cell[0];
+	LASSERT(a, vars->count % 2 == 0,
+		"Function 'loop' passed an odd number of elements for its bindings. "
+		"Expected pairs of a symbol and its initial value.")
+	for (int i = 0; i < vars->count; i += 2) {
+		LASSERT(a, vars->cell[i]->type == LVAL_SYM,
+			"Function 'loop' cannot bind non-symbol. "
+			"Got %s, Expected %s.",
+			ltype_name(vars->cell[i]->type), ltype_name(LVAL_SYM))
+		for (int j = 0; j < i; j += 2) {
+			LASSERT(a, strcmp(vars->cell[i]->data.sym, vars->cell[j]->data.sym) != 0,
+				"Function 'loop' passed the symbol %s twice.", vars->cell[i]->data.sym)
+		}
+	}
+
+	// Initial values are worked out where the loop is
+	int n = vars->count / 2;
+	lenv* frame = lloop_frame(e, n);
+	for (int i = 0; i < n; i++) {
+		lval* v = lval_eval(e, lval_copy(vars->cell[2 * i + 1]));
+		if (v->type == LVAL_ERR) {
+			lenv_pop(frame);
+			lval_del(a);
+			return v;
+		}
+		lenv_bind_formal(frame, vars->cell[2 * i], v);
+	}
+
+	lval* r;
+	long depth = lloop_depth;
+	while (1) {
+		lloop_depth = lvm_depth;
+		r = lval_run(frame, a->cell[1], 1);
+		lloop_depth = depth;
+		if (r != &ltail.call || ltail.f) { break; }
+
+		// (recur ...) hands its values over to the variables
+		lval* x = ltail.a;
+		if (x->count != n) {
+			r = lval_err("Function 'recur' passed incorrect number of arguments. "
+				"Got %i, Expected %i.", x->count, n);
+			lval_del(x);
+			break;
+		}
+		if (frame->refs > 1) {
+			// Closures made by the last run keep its frame as it was
+			lenv_pop(frame);
+			frame = lloop_frame(e, n);
+			for (int i = 0; i < n; i++) { lenv_bind_formal(frame, vars->cell[2 * i], x->cell[i]); }
+		} else {
+			for (int i = 0; i < n; i++) {
+				lval_del(frame->cells[i]->val);
+				frame->cells[i]->val = x->cell[i];
+			}
+		}
+		x->count = 0;
+		lval_del(x);
+	}
+	lenv_pop(frame);
+
+	// Any other call in tail position of the body is made here
+	if (r == &ltail.call) {
+		lval* f = ltail.f;
+		r = lval_call(e, f, ltail.a);
+		lval_del(f);
+	}
+	lval_del(a);
+	return r;
+}
+
+lval* builtin_recur(lenv* e, lval* a) {
+	int tail = ltail.pos;
+	ltail.pos = 0;
+	LASSERT(a, tail && lloop_depth == lvm_depth,
+		"Function 'recur' called outside the tail position of 'loop'.")
+
+	ltail.f = NULL;
+	ltail.a = a;
+	return &ltail.call;
+}
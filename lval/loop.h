@@ -0,0 +1,28 @@
+#ifndef LVAL_LOOP
+#define LVAL_LOOP
+#include "base.h"
+
+/*
+    Loops
+    (while {test} {body}) runs body for as long as test is not 0.
+    (dotimes {i n} {body}) runs body with i bound to 0 up to n - 1.
+    (loop {x init ...} {body}) binds each x to the value of its init
+    and runs body, where (recur v ...) in tail position runs it again
+    with the variables set to the values given.
+    The variables live in one frame for the whole loop, updated in place
+    between iterations, unless a closure or delay made in the body holds
+    on to it, when the next iteration gets a fresh one. '=' in the body
+    sets names bound outside it where they are bound. Each gives ()
+    unless the body of 'loop' ends in something other than 'recur'.
+*/
+
+// Lambda calls in progress when the innermost 'loop' started running
+// its body, or -1 outside of any
+extern long lloop_depth;
+
+lval* builtin_while(lenv* e, lval* a);
+lval* builtin_dotimes(lenv* e, lval* a);
+lval* builtin_loop(lenv* e, lval* a);
+lval* builtin_recur(lenv* e, lval* a);
+
+#endif
@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <string.h>
+#include "macro.h"
+#include "environment.h"
+#include "expressions.h"
+#include "operations.h"
+#include "vm.h"
+#include "error.h"
+#include "memory.h"
+
+int lmacro_count = 0;
+
+// Names made up for the bindings of expansions so far
+static long lmacro_names = 0;
+
+// Expansions replaced while they may still be running
+static lval* lmacro_retired = NULL;
+static long lmacro_running = 0;
+
+lval* lmacro_lookup(lenv* e, lval* x) {
+	if (x->count == 0 || x->cell[0]->type != LVAL_SYM) { return NULL; }
+	lval* m = lenv_lookup(e, x->cell[0]);
+	return m && m->type == LVAL_FUN && m->fun->macro ? m : NULL;
+}
+
+// Position of symbol s in the Q-Expression of symbols names, or -1
+// Later names shadow earlier ones
+static int lmacro_find(lval* names, lval* s) {
+	for (int i = names->count - 1; i >= 0; i--) {
+		if (strcmp(names->cell[i]->data.sym, s->data.sym) == 0) { return i; }
+	}
+	return -1;
+}
+
+// A name no code can spell, as '#' is not a symbol character
+static lval* lmacro_fresh(lval* s) {
+	int n = snprintf(NULL, 0, "%s#%li", s->data.sym, lmacro_names + 1);
+	char* sym = (char*) lmem_xalloc(LVAL_SYM, n + 1);
+	snprintf(sym, n + 1, "%s#%li", s->data.sym, ++lmacro_names);
+	lval* x = lval_sym(sym);
+	lmem_free(sym);
+	return x;
+}
+
+// Give a name the template binds a fresh one for the rest of its scope
+static void lmacro_bind(lval* s, lval* names, lval* vals) {
+	if (s->type != LVAL_SYM || strcmp(s->data.sym, "&") == 0) { return; }
+	lval_add(names, lval_copy(s));
+	lval_add(vals, lmacro_fresh(s));
+}
+
+// Leave the scopes entered since there were n names
+static void lmacro_unbind(lval* names, lval* vals, int n) {
+	while (names->count > n) {
+		lval_del(lval_pop(names, names->count - 1));
+		lval_del(lval_pop(vals, vals->count - 1));
+	}
+}
+
+// A copy of t with each of names put in place of its value in vals
+// Forms of '\', 'loop' and 'dotimes' in t rename what they bind within
+// their scope, and names left free refer to globals
+static lval* lmacro_fill(lval* t, lval* names, lval* vals) {
+	if (t->type == LVAL_SYM) {
+		int i = lmacro_find(names, t);
+		if (i != -1) { return lval_copy(vals->cell[i]); }
+		lval* x = lval_copy(t);
+		x->depth = LENV_GLOBAL;
+		x->cache = NULL;
+		return x;
+	}
+	if (t->type != LVAL_SEXPR && t->type != LVAL_QEXPR) { return lval_copy(t); }
+
+	lval* x = t->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+	int n = names->count;
+	int i = 0;
+	if (t->count >= 2 && t->cell[0]->type == LVAL_SYM && t->cell[1]->type == LVAL_QEXPR
+		&& t->cell[1]->count && lmacro_find(names, t->cell[0]) == -1) {
+		char* head = t->cell[0]->data.sym;
+		lval* b = t->cell[1];
+		if (strcmp(head, "\\") == 0) {
+			for (int j = 0; j < b->count; j++) { lmacro_bind(b->cell[j], names, vals); }
+		} else if (strcmp(head, "loop") == 0 || strcmp(head, "dotimes") == 0) {
+			// The values given to the names are outside their scope
+			int step = head[0] == 'l' ? 2 : b->count;
+			lval* y = lval_qexpr();
+			for (int j = 0; j < b->count; j++) {
+				lval_add(y, j % step ? lmacro_fill(b->cell[j], names, vals) : lval_sexpr());
+			}
+			for (int j = 0; j < b->count; j += step) { lmacro_bind(b->cell[j], names, vals); }
+			for (int j = 0; j < b->count; j += step) {
+				lval_del(y->cell[j]);
+				y->cell[j] = lmacro_fill(b->cell[j], names, vals);
+			}
+			lval_add(x, lmacro_fill(t->cell[0], names, vals));
+			lval_add(x, y);
+			i = 2;
+		}
+	}
+	for (; i < t->count; i++) { lval_add(x, lmacro_fill(t->cell[i], names, vals)); }
+	lmacro_unbind(names, vals, n);
+	return x;
+}
+
+lval* lmacro_expand(lval* m, lval* x) {
+	lparams* p = m->fun->params;
+	int n = p->rest == -1 ? p->syms->count : p->rest;
+	int argc = x->count - 1;
+	if (argc < n || (p->rest == -1 && argc > n)) {
+		return lval_err("Macro '%s' passed incorrect number of arguments. "
+			"Got %i, Expected %i.", x->cell[0]->data.sym, argc, n);
+	}
+
+	// Formals stand for the code of their arguments, the one after '&'
+	// for a list of the rest
+	lval* names = lval_qexpr();
+	lval* vals = lval_qexpr();
+	for (int i = 0; i < n; i++) {
+		lval_add(names, lval_copy(p->syms->cell[i]));
+		lval_add(vals, lval_copy(x->cell[i + 1]));
+	}
+	if (p->rest != -1) {
+		lval* rest = lval_qexpr();
+		for (int i = n; i < argc; i++) { lval_add(rest, lval_copy(x->cell[i + 1])); }
+		lval_add(names, lval_copy(p->syms->cell[p->rest + 1]));
+		lval_add(vals, rest);
+	}
+	lval* code = lmacro_fill(lval_body(m), names, vals);
+	lval_del(names);
+	lval_del(vals);
+
+	// Copies refused by the heap budget leave errors in the code, which
+	// is not kept
+	if (lmem_exhausted()) {
+		lval_del(code);
+		return lmem_err();
+	}
+	return code;
+}
+
+lval* lmacro_run(lenv* e, lval* m, lval* x, int tail) {
+	if (x->expansion == NULL || x->macro != m->fun->macro) {
+		lval* code = lmacro_expand(m, x);
+		if (code->type == LVAL_ERR) { return code; }
+		if (x->expansion) {
+			if (lmacro_retired == NULL) { lmacro_retired = lval_qexpr(); }
+			lval_add(lmacro_retired, x->expansion);
+		}
+		x->expansion = code;
+		x->macro = m->fun->macro;
+	}
+
+	lmacro_running++;
+	lval* r = lval_run(e, x->expansion, tail);
+
+	// Compiled code may still hold calls within an expansion replaced
+	// while it ran, until nothing does
+	if (--lmacro_running == 0 && lvm_depth == 0 && lmacro_retired) {
+		lval_del(lmacro_retired);
+		lmacro_retired = NULL;
+	}
+	return r;
+}
+
+void lmacro_expand_all(lenv* e, lval* formals, lval* x) {
+	lval* m = lmacro_lookup(e, x);
+	if (m && lmacro_find(formals, x->cell[0]) == -1) {
+		if (x->expansion && x->macro == m->fun->macro) { return; }
+
+		// Calls that fail to expand are left to fail when they run
+		lval* code = lmacro_expand(m, x);
+		if (code->type == LVAL_ERR) { lval_del(code); return; }
+		if (x->expansion) { lval_del(x->expansion); }
+		x->expansion = code;
+		x->macro = m->fun->macro;
+		return;
+	}
+
+	for (int i = 0; i < x->count; i++) {
+		lval* y = x->cell[i];
+		if (y->type == LVAL_SEXPR || y->type == LVAL_QEXPR) { lmacro_expand_all(e, formals, y); }
+	}
+}
+
+lval* builtin_defmacro(lenv* e, lval* a) {
+	LASSERT_NUM("defmacro", a, 3)
+	LASSERT_TYPE("defmacro", a, 0, LVAL_QEXPR)
+	LASSERT_TYPE("defmacro", a, 1, LVAL_QEXPR)
+	LASSERT_TYPE("defmacro", a, 2, LVAL_QEXPR)
+	LASSERT(a, a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM,
+		"Function 'defmacro' passed an invalid name. Expected {symbol}.")
+
+	lval* formals = a->cell[1];
+	for (int i = 0; i < formals->count; i++) {
+		LASSERT(a, formals->cell[i]->type == LVAL_SYM,
+			"Function 'defmacro' cannot define non-symbol. "
+			"Got %s, Expected %s.",
+			ltype_name(formals->cell[i]->type), ltype_name(LVAL_SYM))
+		LASSERT(a, strcmp(formals->cell[i]->data.sym, "&") != 0 || i == formals->count - 2,
+			"Function 'defmacro' passed an invalid format. "
+			"Symbol '&' not followed by single symbol.")
+	}
+
+	lval* name = lval_pop(a, 0);
+	formals = lval_pop(a, 0);
+	lval* m = lval_lambda(e, formals, lval_take(a, 0));
+	m->fun->macro = ++lmacro_count;
+	lenv_def(e, name->cell[0], m);
+	lval_del(name);
+	lval_del(m);
+	return lval_sexpr();
+}
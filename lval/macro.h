@@ -0,0 +1,39 @@
+#ifndef LVAL_MACRO
+#define LVAL_MACRO
+#include "base.h"
+
+/*
+    Macros
+    (defmacro {name} {formals} {template}) binds name to a macro. A call
+    to it runs a copy of the template in its place, with each formal
+    replaced by the code of its argument as written, and the one after
+    '&' by a list of the rest. Names the template binds of its own with
+    '\', 'loop' or 'dotimes' are given fresh ones no code can spell over
+    their scope, so they never capture the code passed in and formals
+    they shadow are left alone. Any other name in the template means
+    what it does globally, wherever the call is.
+    A call is expanded when the lambda holding it is defined, or else
+    when it first runs, and the expansion is kept on the call for every
+    later run. Each definition gets a new number, so a call expanded by
+    a macro since redefined is expanded again.
+*/
+
+// Numbers given to macros so far
+extern int lmacro_count;
+
+// The macro bound to the head of call x in e, or NULL
+lval* lmacro_lookup(lenv* e, lval* x);
+
+// The expansion of call x by macro m
+lval* lmacro_expand(lval* m, lval* x);
+
+// Run call x to macro m in e, expanding it only if not already done
+lval* lmacro_run(lenv* e, lval* m, lval* x, int tail);
+
+// Expand the calls to macros in the body of a lambda being defined,
+// other than those through its formals
+void lmacro_expand_all(lenv* e, lval* formals, lval* body);
+
+lval* builtin_defmacro(lenv* e, lval* a);
+
+#endif
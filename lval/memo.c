@@ -0,0 +1,186 @@
+#include <string.h>
+#include "memo.h"
+#include "environment.h"
+#include "expressions.h"
+#include "numbers.h"
+#include "operations.h"
+#include "conditionals.h"
+#include "hashcons.h"
+#include "error.h"
+#include "memory.h"
+
+struct lmemo_entry {
+    unsigned long hash;
+    lval* args;
+    lval* result;
+
+    // Next in the bucket, and neighbours in order of use
+    lmemo_entry* next;
+    lmemo_entry* newer;
+    lmemo_entry* older;
+};
+
+static lmemo* lmemo_new(long capacity) {
+	lmemo* m = (lmemo*) lmem_xalloc(LVAL_FUN, sizeof(lmemo));
+	memset(m, 0, sizeof(lmemo));
+	m->refs = 1;
+	m->capacity = capacity;
+	return m;
+}
+
+lmemo* lmemo_retain(lmemo* m) {
+	if (m) { m->refs++; }
+	return m;
+}
+
+void lmemo_release(lmemo* m) {
+	if (m == NULL || --m->refs > 0) { return; }
+	lmemo_entry* x = m->newest;
+	while (x) {
+		lmemo_entry* older = x->older;
+		lval_del(x->args);
+		lval_del(x->result);
+		lmem_free(x);
+		x = older;
+	}
+	lmem_free(m->buckets);
+	lmem_free(m);
+}
+
+static lmemo_entry* lmemo_find(lmemo* m, lval* a, unsigned long h) {
+	if (m->nbuckets == 0) { return NULL; }
+	for (lmemo_entry* x = m->buckets[h & (m->nbuckets - 1)]; x; x = x->next) {
+		if (x->hash == h && lval_eq(x->args, a)) { return x; }
+	}
+	return NULL;
+}
+
+static void lmemo_unlink(lmemo* m, lmemo_entry* x) {
+	if (x->newer) { x->newer->older = x->older; } else { m->newest = x->older; }
+	if (x->older) { x->older->newer = x->newer; } else { m->oldest = x->newer; }
+}
+
+static void lmemo_push(lmemo* m, lmemo_entry* x) {
+	x->newer = NULL;
+	x->older = m->newest;
+	if (m->newest) { m->newest->newer = x; } else { m->oldest = x; }
+	m->newest = x;
+}
+
+// Drop the least recently used entry
+static void lmemo_evict(lmemo* m) {
+	lmemo_entry* x = m->oldest;
+	lmemo_entry** p = &m->buckets[x->hash & (m->nbuckets - 1)];
+	while (*p != x) { p = &(*p)->next; }
+	*p = x->next;
+	lmemo_unlink(m, x);
+	lval_del(x->args);
+	lval_del(x->result);
+	lmem_free(x);
+	m->count--;
+	m->evictions++;
+}
+
+static void lmemo_grow(lmemo* m) {
+	if (m->count < m->nbuckets) { return; }
+	long size = m->nbuckets ? m->nbuckets * 2 : 16;
+	lmemo_entry** buckets = (lmemo_entry**) lmem_xalloc(LVAL_FUN, sizeof(lmemo_entry*) * size);
+	memset(buckets, 0, sizeof(lmemo_entry*) * size);
+	for (lmemo_entry* x = m->newest; x; x = x->older) {
+		x->next = buckets[x->hash & (size - 1)];
+		buckets[x->hash & (size - 1)] = x;
+	}
+	lmem_free(m->buckets);
+	m->buckets = buckets;
+	m->nbuckets = size;
+}
+
+static void lmemo_insert(lmemo* m, lval* a, unsigned long h, lval* r) {
+	while (m->count >= m->capacity) { lmemo_evict(m); }
+	lmemo_grow(m);
+
+	lmemo_entry* x = (lmemo_entry*) lmem_xalloc(LVAL_FUN, sizeof(lmemo_entry));
+	x->hash = h;
+	x->args = a;
+	x->result = r;
+	x->next = m->buckets[h & (m->nbuckets - 1)];
+	m->buckets[h & (m->nbuckets - 1)] = x;
+	lmemo_push(m, x);
+	m->count++;
+}
+
+lval* lmemo_call(lenv* e, lval* f, lval* a) {
+	lmemo* m = f->fun->memo;
+	unsigned long h = lval_hash(a);
+	lmemo_entry* x = lmemo_find(m, a, h);
+	if (x) {
+		m->hits++;
+		lmemo_unlink(m, x);
+		lmemo_push(m, x);
+		lval_del(a);
+		return lval_copy(x->result);
+	}
+	m->misses++;
+
+	// The arguments go to the call, so the key is a copy of them
+	lval* key = lval_copy(a);
+	lval* r = lval_call_lambda(e, f, a);
+
+	// Recursive calls may have changed the table in the meantime
+	if (r->type == LVAL_ERR || lmem_exhausted() || lmemo_find(m, key, h)) {
+		lval_del(key);
+	} else {
+		lmemo_insert(m, key, h, lval_copy(r));
+	}
+	return r;
+}
+
+lval* builtin_memo(lenv* e, lval* a) {
+	LASSERT(a, a->count == 1 || a->count == 2,
+		"Function 'memo' passed incorrect number of arguments. "
+		"Got %i, Expected %i or %i.", a->count, 1, 2)
+	LASSERT_TYPE("memo", a, 0, LVAL_FUN)
+	LASSERT(a, a->cell[0]->fun->builtin == NULL,
+		"Function 'memo' passed a builtin for argument 0. Expected a lambda.")
+
+	long capacity = LMEMO_CAPACITY;
+	if (a->count == 2) {
+		LASSERT_TYPE("memo", a, 1, LVAL_LONG)
+		LASSERT(a, a->cell[1]->data.num > 0,
+			"Function 'memo' passed a capacity below one.")
+		capacity = a->cell[1]->data.num;
+	}
+
+	// A memoized function wrapped again starts on a table of its own,
+	// and copies made before keep theirs
+	lval* f = lval_take(a, 0);
+	lfun* g = lfun_copy(f->fun);
+	lfun_release(f->fun);
+	f->fun = g;
+	lmemo_release(g->memo);
+	g->memo = lmemo_new(capacity);
+	return f;
+}
+
+// Build an entry of the form {name value}
+static lval* lmemo_stat(char* name, long x) {
+	lval* v = lval_add(lval_qexpr(), lval_sym(name));
+	return lval_add(v, lval_long(x));
+}
+
+lval* builtin_memo_stats(lenv* e, lval* a) {
+	LASSERT_NUM("memo-stats", a, 1)
+	LASSERT_TYPE("memo-stats", a, 0, LVAL_FUN)
+	LASSERT(a, a->cell[0]->fun->memo != NULL,
+		"Function 'memo-stats' passed a function that is not memoized.")
+
+	lmemo* m = a->cell[0]->fun->memo;
+	lval* x = lval_qexpr();
+	lval_add(x, lmemo_stat("hits", m->hits));
+	lval_add(x, lmemo_stat("misses", m->misses));
+	lval_add(x, lmemo_stat("size", m->count));
+	lval_add(x, lmemo_stat("capacity", m->capacity));
+	lval_add(x, lmemo_stat("evictions", m->evictions));
+	lval_del(a);
+	return x;
+}
@@ -0,0 +1,46 @@
+#ifndef LVAL_MEMO
+#define LVAL_MEMO
+#include "base.h"
+
+/*
+    Memoized functions
+    (memo f) is the lambda f with a table of the results it has given,
+    keyed on the structural hash of the arguments and checked with
+    lval_eq. Copies of it share the table, so a recursive definition
+    bound to it looks its own calls up. Once the table holds its
+    capacity the least recently used result makes way for a new one.
+    Errors are never kept, as running out of heap or stack is not a
+    property of the arguments.
+*/
+#define LMEMO_CAPACITY 4096
+
+typedef struct lmemo_entry lmemo_entry;
+
+struct lmemo {
+    int refs;
+
+    // Buckets of entries by hash
+    lmemo_entry** buckets;
+    long nbuckets;
+
+    // Entries from the most to the least recently used
+    lmemo_entry* newest;
+    lmemo_entry* oldest;
+    long count;
+    long capacity;
+
+    long hits;
+    long misses;
+    long evictions;
+};
+
+lmemo* lmemo_retain(lmemo* m);
+void lmemo_release(lmemo* m);
+
+// Call the memoized function f, taking the arguments a
+lval* lmemo_call(lenv* e, lval* f, lval* a);
+
+lval* builtin_memo(lenv* e, lval* a);
+lval* builtin_memo_stats(lenv* e, lval* a);
+
+#endif
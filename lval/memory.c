@@ -0,0 +1,350 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+#include "memory.h"
+#include "error.h"
+#include "numbers.h"
+#include "expressions.h"
+#include "operations.h"
+
+lmem_stats lmem;
+
+// Every block carries a small header so it can be accounted for on free
+typedef union lmem_header {
+	struct {
+		size_t size;
+		int kind;
+		int budget;
+	} h;
+	// Keep the payload suitably aligned
+	long double align;
+} lmem_header;
+
+#define LMEM_HEADER(p) ((lmem_header*) (p) - 1)
+
+// Memory held back so that an error can still be built and unwound
+// after the system allocator has failed
+#define LMEM_RESERVE (64 * 1024)
+static void* lmem_reserve = NULL;
+
+// Budgets by number, and the one the form running is charged to, of
+// which there is only ever one since sessions are single-threaded
+static lmem_budget lmem_first;
+static lmem_budget* lmem_budgets = &lmem_first;
+static int lmem_nbudgets = 1;
+static int lmem_charged = 0;
+static int lmem_exempting = 0;
+
+int lmem_budget_new(void) {
+	lmem_budget* b = (lmem_budget*) malloc(sizeof(lmem_budget) * (lmem_nbudgets + 1));
+	if (b == NULL) {
+		fputs("Fatal: out of memory\n", stderr);
+		abort();
+	}
+	memcpy(b, lmem_budgets, sizeof(lmem_budget) * lmem_nbudgets);
+	memset(&b[lmem_nbudgets], 0, sizeof(lmem_budget));
+	if (lmem_budgets != &lmem_first) { free(lmem_budgets); }
+	lmem_budgets = b;
+	return lmem_nbudgets++;
+}
+
+static void lmem_account(int kind, int budget, long bytes) {
+	lmem.bytes[kind] += bytes;
+	long total = lmem_total_bytes();
+	if (total > lmem.peak_bytes) { lmem.peak_bytes = total; }
+
+	lmem_budget* b = &lmem_budgets[budget];
+	b->used += bytes;
+	if (b->limit && b->used > b->limit) { b->exhausted = 1; }
+}
+
+// malloc/realloc with a fallback on the reserve
+static void* lmem_system(void* p, size_t size) {
+	if (lmem_reserve == NULL && !lmem_exhausted()) { lmem_reserve = malloc(LMEM_RESERVE); }
+
+	void* x = realloc(p, size);
+	if (x == NULL) {
+		lmem_budgets[lmem_charged].exhausted = 1;
+		free(lmem_reserve);
+		lmem_reserve = NULL;
+		x = realloc(p, size);
+	}
+	if (x == NULL) {
+		fputs("Fatal: out of memory\n", stderr);
+		abort();
+	}
+	return x;
+}
+
+// Whether the budget charged may take size more bytes, marking it as
+// exhausted when it may not
+static int lmem_fits(long size) {
+	lmem_budget* b = &lmem_budgets[lmem_charged];
+	if (b->limit == 0 || lmem_exempting || b->used + size <= b->limit) { return 1; }
+	b->exhausted = 1;
+	return 0;
+}
+
+// Tag a new block and charge it to the form running
+static void* lmem_take(lmem_header* h, int kind, size_t size) {
+	h->h.size = size;
+	h->h.kind = kind;
+	h->h.budget = lmem_charged;
+	lmem.allocs++;
+	lmem_account(kind, lmem_charged, sizeof(lmem_header) + size);
+	return h + 1;
+}
+
+// The block resized moves over to the budget growing it
+static void* lmem_retake(lmem_header* h, long old, size_t size) {
+	h->h.size = size;
+	lmem_account(h->h.kind, h->h.budget, -old);
+	h->h.budget = lmem_charged;
+	lmem_account(h->h.kind, lmem_charged, sizeof(lmem_header) + size);
+	return h + 1;
+}
+
+void* lmem_alloc(int kind, size_t size) {
+	if (!lmem_fits(sizeof(lmem_header) + size)) { return NULL; }
+	lmem_header* h = (lmem_header*) malloc(sizeof(lmem_header) + size);
+	if (h == NULL) {
+		lmem_budgets[lmem_charged].exhausted = 1;
+		return NULL;
+	}
+	return lmem_take(h, kind, size);
+}
+
+void* lmem_xalloc(int kind, size_t size) {
+	return lmem_take((lmem_header*) lmem_system(NULL, sizeof(lmem_header) + size), kind, size);
+}
+
+void* lmem_realloc(int kind, void* p, size_t size) {
+	if (p == NULL) { return size ? lmem_alloc(kind, size) : NULL; }
+	if (size == 0) { lmem_free(p); return NULL; }
+
+	// Only what the budget running does not hold yet is charged anew
+	lmem_header* h = LMEM_HEADER(p);
+	long old = sizeof(lmem_header) + h->h.size;
+	long grow = sizeof(lmem_header) + size - (h->h.budget == lmem_charged ? old : 0);
+	if (grow > 0 && !lmem_fits(grow)) { return NULL; }
+	lmem_header* x = (lmem_header*) realloc(h, sizeof(lmem_header) + size);
+	if (x == NULL) {
+		lmem_budgets[lmem_charged].exhausted = 1;
+		return NULL;
+	}
+	return lmem_retake(x, old, size);
+}
+
+void* lmem_xrealloc(int kind, void* p, size_t size) {
+	if (p == NULL) { return size ? lmem_xalloc(kind, size) : NULL; }
+	if (size == 0) { lmem_free(p); return NULL; }
+
+	lmem_header* h = LMEM_HEADER(p);
+	long old = sizeof(lmem_header) + h->h.size;
+	return lmem_retake((lmem_header*) lmem_system(h, sizeof(lmem_header) + size), old, size);
+}
+
+void lmem_free(void* p) {
+	if (p == NULL) { return; }
+	lmem_header* h = LMEM_HEADER(p);
+	lmem.frees++;
+	lmem_account(h->h.kind, h->h.budget, -(long) (sizeof(lmem_header) + h->h.size));
+	free(h);
+}
+
+char* lmem_strdup(int kind, char* s) {
+	char* x = (char*) lmem_xalloc(kind, strlen(s) + 1);
+	strcpy(x, s);
+	return x;
+}
+
+static lval* lval_init(lval* v, int type) {
+	memset(v, 0, sizeof(lval));
+	v->type = type;
+	lmem.live[type]++;
+	return v;
+}
+
+lval* lval_alloc(int type) { return lval_init((lval*) lmem_xalloc(type, sizeof(lval)), type); }
+
+lval* lval_try_alloc(int type) {
+	lval* v = (lval*) lmem_alloc(type, sizeof(lval));
+	return v ? lval_init(v, type) : NULL;
+}
+
+void lval_free(lval* v) {
+	lmem.live[LMEM_HEADER(v)->h.kind]--;
+	lmem_free(v);
+}
+
+// Move an allocated block over to another kind
+static void lmem_move(void* p, int kind) {
+	lmem_header* h = LMEM_HEADER(p);
+	long bytes = sizeof(lmem_header) + h->h.size;
+	lmem.bytes[h->h.kind] -= bytes;
+	lmem.bytes[kind] += bytes;
+	h->h.kind = kind;
+}
+
+void lval_retype(lval* v, int type) {
+	lmem.live[LMEM_HEADER(v)->h.kind]--;
+	lmem.live[type]++;
+	lmem_move(v, type);
+	if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->cell) {
+		lmem_move(v->cell, type);
+	}
+	v->type = type;
+}
+
+void lmem_count_copy(void) { lmem.copies++; }
+
+// Where the C stack stood when the form began, and how far it may grow
+static uintptr_t lmem_stack_base = 0;
+static long lmem_stack_budget = 0;
+
+void lmem_form_begin(int budget) {
+	lmem.form_start = lmem.copies;
+	lmem_charged = budget;
+	lmem_budgets[budget].exhausted = 0;
+
+	char here;
+	lmem_stack_base = (uintptr_t) &here;
+	if (lmem_stack_budget == 0) {
+		long size = 1024 * 1024;
+#ifndef _WIN32
+		struct rlimit r;
+		if (getrlimit(RLIMIT_STACK, &r) == 0 && r.rlim_cur != RLIM_INFINITY) {
+			size = (long) r.rlim_cur;
+		} else {
+			size = 8 * 1024 * 1024;
+		}
+#endif
+		// Leave a quarter for the builtins and the way back out
+		lmem_stack_budget = size / 4 * 3;
+	}
+}
+
+int lmem_stack_exhausted(void) {
+	if (lmem_stack_base == 0) { return 0; }
+	char here;
+	uintptr_t p = (uintptr_t) &here;
+	uintptr_t used = lmem_stack_base > p ? lmem_stack_base - p : p - lmem_stack_base;
+	return used > (uintptr_t) lmem_stack_budget;
+}
+
+long lmem_stack_left(void) {
+	if (lmem_stack_base == 0) { return 0; }
+	char here;
+	uintptr_t p = (uintptr_t) &here;
+	uintptr_t used = lmem_stack_base > p ? lmem_stack_base - p : p - lmem_stack_base;
+	return used > (uintptr_t) lmem_stack_budget ? 0 : lmem_stack_budget - (long) used;
+}
+
+void lmem_form_end(void) { lmem.form_copies = lmem.copies - lmem.form_start; }
+
+void lmem_reset(void) {
+	lmem.allocs = 0;
+	lmem.frees = 0;
+	lmem.copies = 0;
+	lmem.form_start = 0;
+	lmem.form_copies = 0;
+	lmem.peak_bytes = lmem_total_bytes();
+}
+
+long lmem_total_bytes(void) {
+	long total = 0;
+	for (int i = 0; i < LMEM_KINDS; i++) { total += lmem.bytes[i]; }
+	return total;
+}
+
+long lmem_peak_rss(void) {
+#ifdef _WIN32
+	return 0;
+#else
+	// Reported in kilobytes on Linux
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+#endif
+}
+
+void lmem_set_limit(int budget, long bytes) {
+	lmem_budget* b = &lmem_budgets[budget];
+	b->limit = bytes;
+	b->exhausted = bytes && b->used > bytes;
+}
+
+int lmem_exhausted(void) { return lmem_budgets[lmem_charged].exhausted; }
+
+void lmem_exempt(int on) { lmem_exempting += on ? 1 : -1; }
+
+lval* lmem_err(void) {
+	long limit = lmem_budgets[lmem_charged].limit;
+	if (limit) {
+		return lval_err("Out of memory. Heap limit of %li bytes exceeded.", limit);
+	}
+	return lval_err("Out of memory.");
+}
+
+// Build an entry of the form {name value...}
+static lval* lmem_entry(char* name, int n, long x, long y) {
+	lval* v = lval_add(lval_qexpr(), lval_sym(name));
+	v = lval_add(v, lval_long(x));
+	if (n > 1) { v = lval_add(v, lval_long(y)); }
+	return v;
+}
+
+lval* builtin_mem_stats(lenv* e, lval* a) {
+	LASSERT(a, a->count <= 1,
+		"Function 'mem-stats' passed too many arguments. "
+		"Got %i, Expected %i.", a->count, 1)
+	if (a->count == 1) {
+		LASSERT_TYPE("mem-stats", a, 0, LVAL_QEXPR)
+		LASSERT(a, a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM &&
+			strcmp(a->cell[0]->cell[0]->data.sym, "reset") == 0,
+			"Function 'mem-stats' only accepts the option {reset}.")
+	}
+
+	// Take the snapshot before the answer itself is built
+	lmem_stats s = lmem;
+	long total = lmem_total_bytes();
+	long limit = lmem_budgets[lmem_charged].limit;
+
+	lval* x = lval_qexpr();
+	for (int i = 0; i < LVAL_NTYPES; i++) {
+		x = lval_add(x, lmem_entry(ltype_name(i), 2, s.live[i], s.bytes[i]));
+	}
+	x = lval_add(x, lmem_entry("Environment", 2, s.live[LMEM_ENV], s.bytes[LMEM_ENV]));
+	x = lval_add(x, lmem_entry("frame-stack", 1, lenv_stack_usage(), 0));
+	x = lval_add(x, lmem_entry("total-bytes", 1, total, 0));
+	x = lval_add(x, lmem_entry("peak-bytes", 1, s.peak_bytes, 0));
+	x = lval_add(x, lmem_entry("peak-rss-kb", 1, lmem_peak_rss(), 0));
+	x = lval_add(x, lmem_entry("heap-limit", 1, limit, 0));
+	x = lval_add(x, lmem_entry("allocs", 1, s.allocs, 0));
+	x = lval_add(x, lmem_entry("frees", 1, s.frees, 0));
+	x = lval_add(x, lmem_entry("copies", 1, s.copies, 0));
+	x = lval_add(x, lmem_entry("form-copies", 1, s.form_copies, 0));
+
+	if (a->count == 1) { lmem_reset(); }
+
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_heap_limit(lenv* e, lval* a) {
+	LASSERT_NUM("heap-limit", a, 1)
+	LASSERT_TYPE("heap-limit", a, 0, LVAL_LONG)
+	LASSERT(a, a->cell[0]->data.num >= 0,
+		"Function 'heap-limit' passed a negative limit.")
+
+	// Hand back the previous limit of the session running
+	lval* x = lval_long(lmem_budgets[lmem_charged].limit);
+	lmem_set_limit(lmem_charged, a->cell[0]->data.num);
+	lval_del(a);
+	return x;
+}
@@ -0,0 +1,102 @@
+#ifndef LVAL_MEMORY
+#define LVAL_MEMORY
+#include <stddef.h>
+#include "base.h"
+
+/*
+    Allocator layer for lispy values
+    Every lval struct and its payload (strings, cell arrays) as well as
+    environments are allocated through here so that they can be counted.
+    Allocations are tagged with a kind: one of the LVAL_* types, or LMEM_ENV
+*/
+#define LMEM_ENV   LVAL_NTYPES
+#define LMEM_KINDS (LVAL_NTYPES + 1)
+
+typedef struct lmem_stats {
+    // Live objects and bytes per kind
+    long live[LMEM_KINDS];
+    long bytes[LMEM_KINDS];
+
+    // Cumulative counters (cleared on reset)
+    long allocs;
+    long frees;
+    long copies;
+    long peak_bytes;
+
+    // Number of lval_copy calls while evaluating the last top level form
+    long form_copies;
+    long form_start;
+} lmem_stats;
+
+extern lmem_stats lmem;
+
+// Raw allocation of payload bytes attributed to a kind, NULL when the
+// heap budget refuses it (see below)
+void* lmem_alloc(int kind, size_t size);
+void* lmem_realloc(int kind, void* p, size_t size);
+// The same for blocks that may not fail
+void* lmem_xalloc(int kind, size_t size);
+void* lmem_xrealloc(int kind, void* p, size_t size);
+void lmem_free(void* p);
+char* lmem_strdup(int kind, char* s);
+
+// Allocation of the lval struct itself, zero initialised
+lval* lval_alloc(int type);
+// The same, NULL when the heap budget refuses it
+lval* lval_try_alloc(int type);
+void lval_free(lval* v);
+
+// Change the type of an lval while keeping the statistics in order
+void lval_retype(lval* v, int type);
+
+// Bookkeeping hooks
+void lmem_count_copy(void);
+// A top level form starts, charged to the given budget
+void lmem_form_begin(int budget);
+void lmem_form_end(void);
+void lmem_reset(void);
+long lmem_total_bytes(void);
+long lmem_peak_rss(void);
+
+/*
+    Heap budget
+    Each session has a budget of its own, numbered, with budget 0 for
+    what is allocated outside any session. Forms run one at a time, so
+    one budget is charged at any moment. A block is charged to the
+    budget of the form that last allocated it and given back to that
+    budget when freed.
+    lmem_alloc and lmem_realloc refuse a block that would take the
+    budget past its limit (or that the system allocator cannot give),
+    returning NULL, and the bignum, list and copy builders turn that
+    into an error. Values, frames and other small bookkeeping go through
+    lmem_xalloc and lmem_xrealloc, which never fail.
+    Either way the budget is marked as exhausted, and the evaluator turns
+    that into an error at its next step so the form unwinds and frees
+    what it built. The mark is cleared at the start of every form.
+*/
+typedef struct lmem_budget {
+    // Bytes allowed (0 for unlimited), charged so far, and whether the
+    // form running has gone past them
+    long limit;
+    long used;
+    int exhausted;
+} lmem_budget;
+
+int lmem_budget_new(void);
+void lmem_set_limit(int budget, long bytes);
+// Whether the budget of the form running is exhausted
+int lmem_exhausted(void);
+// While exempt (nesting), lmem_alloc is never refused either, for code
+// built on behalf of a body already in memory
+void lmem_exempt(int on);
+lval* lmem_err(void);
+
+// Whether the tree walker has used up the C stack it may recurse on
+int lmem_stack_exhausted(void);
+// and how much further it may still grow
+long lmem_stack_left(void);
+
+lval* builtin_mem_stats(lenv* e, lval* a);
+lval* builtin_heap_limit(lenv* e, lval* a);
+
+#endif
@@ -1,17 +1,17 @@
 #include <stdlib.h>
 #include "numbers.h"
 #include "error.h"
+#include "memory.h"
+#include "bignum.h"
 
 lval* lval_long(long x) {
-	lval* v = (lval *) malloc(sizeof(lval));
-	v->type = LVAL_LONG;
+	lval* v = lval_alloc(LVAL_LONG);
 	v->data.num = x;
 	return v;
 }
 
 lval* lval_double(double x) {
-	lval* v = (lval *) malloc(sizeof(lval));
-	v->type = LVAL_DOUBLE;
+	lval* v = lval_alloc(LVAL_DOUBLE);
 	v->data.dec = x;
 	return v;
 }
@@ -77,10 +77,12 @@ lval* lval_read_long(mpc_ast_t* t) {
 		errno = 0;
 		long x = strtol(treeString, NULL, 10);
 
+		// Too large for a long, it is read as a big integer instead
+		lval* v = errno != ERANGE ? lval_long(x) : lval_bigint(lbig_read(treeString));
+
 		// Free the memory allocated in treestring since it's no longer needed
 		free(treeString);
-		
-		return errno != ERANGE ? lval_long(x) : lval_err("Invalid Number");
+		return v;
 }
 
 
@@ -88,14 +90,51 @@ double lval_getData(lval* x) {
 	if (x->type == LVAL_LONG) {
 		return x->data.num;
 	} 
+	if (x->type == LVAL_BIGINT) {
+		return lbig_double(x->data.big);
+	}
 	return x->data.dec;
 } 
 
-void lval_updateData(lval* x, double val, int type) {
-	if (type == LVAL_LONG) {
-		x->data.num = val;
-		return;
-	} 
-	x->data.dec = val;
-} 
+int lnum_is(lval* x) {
+	return x->type == LVAL_LONG || x->type == LVAL_DOUBLE || x->type == LVAL_BIGINT;
+}
+
+void lnum_widen(lval* x) {
+	double d = lval_getData(x);
+	if (x->type == LVAL_BIGINT) { lbig_free(x->data.big); }
+	lval_retype(x, LVAL_DOUBLE);
+	x->data.dec = d;
+}
 
+int lnum_set_big(lval* x, lbig* b) {
+	if (b == NULL) { return 0; }
+	if (x->type == LVAL_BIGINT) { lbig_free(x->data.big); }
+
+	long n;
+	if (lbig_fits(b, &n)) {
+		lbig_free(b);
+		if (x->type != LVAL_LONG) { lval_retype(x, LVAL_LONG); }
+		x->data.num = n;
+	} else {
+		if (x->type != LVAL_BIGINT) { lval_retype(x, LVAL_BIGINT); }
+		x->data.big = b;
+	}
+	return 1;
+}
+
+int lnum_cmp(lval* x, lval* y) {
+	if (x->type == LVAL_DOUBLE || y->type == LVAL_DOUBLE) {
+		double a = lval_getData(x);
+		double b = lval_getData(y);
+		return a < b ? -1 : a > b;
+	}
+	if (x->type == LVAL_LONG && y->type == LVAL_LONG) {
+		return x->data.num < y->data.num ? -1 : x->data.num > y->data.num;
+	}
+
+	// Big integers lie beyond every long, on the side of their sign
+	if (x->type == LVAL_LONG) { return -y->data.big->sign; }
+	if (y->type == LVAL_LONG) { return x->data.big->sign; }
+	return lbig_cmp(x->data.big, y->data.big);
+}
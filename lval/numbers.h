@@ -20,9 +20,24 @@ lval* lval_read_double(mpc_ast_t* t);
 lval* lval_read_long(mpc_ast_t* t);
 
 // Accessing the numeric data in a lval structure
-// TODO: Rename these methods
+// TODO: Rename this method
 double lval_getData(lval* x);
-void lval_updateData(lval* x, double val, int type);
+
+// Numeric kernels switch on the types of both operands at once
+#define LNUM_PAIR(x, y) ((x)->type * LVAL_NTYPES + (y)->type)
+#define LNUM_LL (LVAL_LONG * LVAL_NTYPES + LVAL_LONG)
+#define LNUM_LD (LVAL_LONG * LVAL_NTYPES + LVAL_DOUBLE)
+#define LNUM_DL (LVAL_DOUBLE * LVAL_NTYPES + LVAL_LONG)
+#define LNUM_DD (LVAL_DOUBLE * LVAL_NTYPES + LVAL_DOUBLE)
+
+int lnum_is(lval* x);
+// Turn an integer into a double in place
+void lnum_widen(lval* x);
+// Make b the value of x, as a long when it fits
+// 0, leaving x as it was, for a b that could not be built
+int lnum_set_big(lval* x, lbig* b);
+// Order of two numbers of any type, as -1, 0 or 1
+int lnum_cmp(lval* x, lval* y);
 
 
 #endif
@@ -1,17 +1,26 @@
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
+#include <limits.h>
 #include "numbers.h"
 #include "expressions.h"
 #include "operations.h"
 #include "environment.h"
-
-lval* builtin_op(lenv* e, lval* v, char* sym);
+#include "memory.h"
+#include "vm.h"
+#include "error.h"
+#include "bignum.h"
+#include "hashcons.h"
+#include "memo.h"
+#include "lazy.h"
 
 lval* lval_sym(char* s) {
-	lval* v = (lval *) malloc(sizeof(lval));
-	v->type = LVAL_SYM;
-	v->data.sym = (char *) malloc(strlen(s) + 1);
-	strcpy(v->data.sym, s);
+	lval* v = lval_alloc(LVAL_SYM);
+	v->data.sym = lmem_strdup(LVAL_SYM, s);
+	v->hash = lenv_hash(s);
+	v->depth = LENV_UNRESOLVED;
+	v->slot = 0;
 	return v;
 }
 
@@ -46,6 +55,16 @@ lval* lval_read(mpc_ast_t* t) {
 
 
 lval* lval_eval(lenv* e, lval* v) {
+	// Only the expression it was set for is in tail position
+	int tail = ltail.pos;
+	ltail.pos = 0;
+
+	// Stop evaluating once the heap budget is spent
+	if (lmem_exhausted()) {
+		lval_del(v);
+		return lmem_err();
+	}
+
 	if (v->type == LVAL_SYM) {
 		lval* x = lenv_get(e, v);
 		lval_del(v);
@@ -53,78 +72,134 @@ lval* lval_eval(lenv* e, lval* v) {
 	}
 
 	// Evauluate sexpressions
-	if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
+	if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v, tail); }
 
 	// All other lval types remail the same
 	return v;
 }
 
-void lval_del(lval* v) {
+// Lists are taken apart and copied through a work list instead of by
+// recursion, so that deeply nested data cannot exhaust the C stack
+static lval** lval_work = NULL;
+static int lval_work_count = 0;
+static int lval_work_size = 0;
+
+static void lval_work_push(lval* v) {
+	if (lval_work_count == lval_work_size) {
+		lval_work_size = lval_work_size ? lval_work_size * 2 : 64;
+		lval_work = (lval**) realloc(lval_work, sizeof(lval*) * lval_work_size);
+		if (lval_work == NULL) {
+			fputs("Fatal: out of memory\n", stderr);
+			abort();
+		}
+	}
+	lval_work[lval_work_count++] = v;
+}
+
+// Free a value, leaving the values it holds on the work list
+static void lval_del_one(lval* v) {
+	// Shared nodes go once their last holder lets go
+	if (v->refs) {
+		if (v->refs > 1) { v->refs--; return; }
+		lval_unintern(v);
+		v->refs = 0;
+	}
+
 	switch (v->type) {
 		case LVAL_LONG: break;
 		case LVAL_DOUBLE: break;
-		case LVAL_FUN: 
-			if (!v->builtin) {
-				lenv_del(v->env);
-				lval_del(v->formals);
-				lval_del(v->body);
+		case LVAL_BIGINT: lbig_free(v->data.big); break;
+		case LVAL_THUNK: {
+			// Delays go with their last copy
+			lthunk* t = v->data.thunk;
+			if (--t->refs == 0) {
+				if (t->expr) { lval_work_push(t->expr); }
+				if (t->value) { lval_work_push(t->value); }
+				lenv_release(t->env);
+				lmem_free(t);
 			}
 			break;
+		}
+		case LVAL_FUN: lfun_release(v->fun); break;
 
 		// Free the string data
-		case LVAL_ERR: free(v->data.err); break;
-		case LVAL_SYM: free(v->data.sym); break;
+		case LVAL_ERR: lmem_free(v->data.err); break;
+		case LVAL_SYM: lmem_free(v->data.sym); break;
 
 		// Delete all elements inside SEXPR or QEXPR
 		case LVAL_QEXPR:
 		case LVAL_SEXPR:
 			for (int i = 0; i < v->count; i++) {
-				lval_del(v->cell[i]);
+				lval_work_push(v->cell[i]);
 			}
+			if (v->expansion) { lval_work_push(v->expansion); }
 			// Also free the memory allocated to contain the pointers
-			free(v->cell);
+			lmem_free(v->cell);
 			break;
 
 	}
 
 	// // Free the memory allocated for the lval struct itself
-	free(v);
+	lval_free(v);
 }
 
-lval* lval_copy(lval* v) {
-	lval* x = (lval*) malloc(sizeof(lval));
-	x->type = v->type;
+void lval_del_args(int argc, lval** argv) {
+	for (int i = 0; i < argc; i++) { lval_del(argv[i]); }
+}
+
+void lval_del(lval* v) {
+	// Deleting an environment or code on the way deletes more values,
+	// which stay above the part of the work list that is ours
+	int base = lval_work_count;
+	lval_del_one(v);
+	while (lval_work_count > base) {
+		lval_del_one(lval_work[--lval_work_count]);
+	}
+}
+
+static lval* lval_copy_tree(lval* v);
+
+// Copy a value, leaving the elements of a list to be filled in
+// NULL when the heap budget refuses the memory for it
+static lval* lval_copy_one(lval* v) {
+	lval* x = lval_try_alloc(v->type);
+	if (x == NULL) { return NULL; }
+	lmem_count_copy();
 
 	switch (v->type)  {
 		// Copy numbers and functions directly
 		case LVAL_LONG: x->data.num = v->data.num; break;
 		case LVAL_DOUBLE: x->data.dec = v->data.dec; break;
-		case LVAL_FUN: 
-			if (v->builtin) {
-				x->builtin = v->builtin;
-			} else {
-				x->builtin = NULL;
-				x->env = lenv_copy(v->env);
-				x->formals = lval_copy(v->formals);
-				x->body = lval_copy(v->body);
-			}
-		 	break;
+		case LVAL_BIGINT:
+			x->data.big = lbig_copy(v->data.big);
+			if (x->data.big == NULL) { lval_free(x); return NULL; }
+			break;
+		case LVAL_THUNK: x->data.thunk = v->data.thunk; x->data.thunk->refs++; break;
+		case LVAL_FUN: x->fun = lfun_retain(v->fun); break;
 
-		// Copy strings using malloc and strcpy
-		case LVAL_ERR:
-			x->data.err = (char*) malloc(strlen(v->data.err) + 1);
-			strcpy(x->data.err, v->data.err); break;
+		// Copy strings into freshly allocated memory
+		case LVAL_ERR: x->data.err = lmem_strdup(LVAL_ERR, v->data.err); break;
 		case LVAL_SYM:
-			x->data.sym = (char*) malloc(strlen(v->data.sym) + 1);
-			strcpy(x->data.sym, v->data.sym); break;
+			x->data.sym = (char*) lmem_alloc(LVAL_SYM, strlen(v->data.sym) + 1);
+			if (x->data.sym == NULL) { lval_free(x); return NULL; }
+			strcpy(x->data.sym, v->data.sym);
+			x->hash = v->hash;
+			x->depth = v->depth;
+			x->slot = v->slot;
+			x->cache = v->cache; break;
 		
-		// Copy lists by copying each sub-expression
+		// Lists get room for a copy of each sub-expression
 		case LVAL_SEXPR:
 		case LVAL_QEXPR:
 			x->count = v->count;
-			x->cell = (lval**) malloc(sizeof(lval*) * x->count);
-			for (int i = 0; i < x->count; i++) {
-				x->cell[i] = lval_copy(v->cell[i]);
+			x->cell = (lval**) lmem_alloc(x->type, sizeof(lval*) * x->count);
+			if (x->cell == NULL) { lval_free(x); return NULL; }
+			// Copies of code keep the expansions of its macro calls, as
+			// far as there is room for them
+			if (v->expansion) {
+				x->expansion = lval_copy_tree(v->expansion);
+				x->macro = v->macro;
+				x->fold = v->fold;
 			}
 			break;
 	}
@@ -132,34 +207,337 @@ lval* lval_copy(lval* v) {
 	return x;
 }
 
+static int lval_is_list(lval* v) {
+	return (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->count > 0;
+}
+
+static lval* lval_copy_tree(lval* v) {
+	lval* x = lval_copy_one(v);
+	if (x == NULL || !lval_is_list(v)) { return x; }
+
+	// The work list holds pairs of a list and its copy to fill in
+	int base = lval_work_count;
+	lval_work_push(v);
+	lval_work_push(x);
+	while (lval_work_count > base) {
+		lval* to = lval_work[--lval_work_count];
+		lval* from = lval_work[--lval_work_count];
+		for (int i = 0; i < from->count; i++) {
+			to->cell[i] = lval_copy_one(from->cell[i]);
+			if (to->cell[i] == NULL) {
+				// Lists not filled in yet are cut short, and the copy let go
+				to->count = i;
+				while (lval_work_count > base) {
+					lval_work[--lval_work_count]->count = 0;
+					lval_work_count--;
+				}
+				lval_del(x);
+				return NULL;
+			}
+			if (lval_is_list(from->cell[i])) {
+				lval_work_push(from->cell[i]);
+				lval_work_push(to->cell[i]);
+			}
+		}
+	}
+	return x;
+}
+
+// A copy of v, or the error when the heap budget refuses the room for it
+lval* lval_copy(lval* v) {
+	lval* x = lval_copy_tree(v);
+	return x ? x : lmem_err();
+}
+
+/*
+    Arithmetic
+    Each operator folds its arguments into the first one from left to
+    right. A double joining the fold turns the running result into one.
+    Longs are worked on as 64 bit integers. When they overflow, or a big
+    integer is involved, the kernel carries on in big integers.
+*/
+
+// Pairs involving a big integer, or longs that overflowed
+static int lnum_big(lval* x, lval* y, lnum_kernel k, lbig_op op) {
+	if (y->type == LVAL_DOUBLE) {
+		lnum_widen(x);
+		return k(x, y);
+	}
+	if (x->type == LVAL_DOUBLE) {
+		lval t = { .type = LVAL_DOUBLE };
+		t.data.dec = lval_getData(y);
+		return k(x, &t);
+	}
+
+	lbig* a = x->type == LVAL_BIGINT ? x->data.big : lbig_long(x->data.num);
+	lbig* b = y->type == LVAL_BIGINT ? y->data.big : lbig_long(y->data.num);
+	lbig* r = a && b ? op(a, b) : NULL;
+	if (x->type != LVAL_BIGINT) { lbig_free(a); }
+	if (y->type != LVAL_BIGINT) { lbig_free(b); }
+
+	// Division by zero is caught before, so only memory is missing
+	return lnum_set_big(x, r) ? LNUM_OK : LNUM_NO_MEM;
+}
+
+int lnum_add(lval* x, lval* y) {
+	long r;
+	switch (LNUM_PAIR(x, y)) {
+		case LNUM_LL:
+			if (__builtin_add_overflow(x->data.num, y->data.num, &r)) { break; }
+			x->data.num = r;
+			return LNUM_OK;
+		case LNUM_LD: lnum_widen(x); x->data.dec += y->data.dec; return LNUM_OK;
+		case LNUM_DL: x->data.dec += y->data.num; return LNUM_OK;
+		case LNUM_DD: x->data.dec += y->data.dec; return LNUM_OK;
+	}
+	return lnum_big(x, y, lnum_add, lbig_add);
+}
+
+int lnum_sub(lval* x, lval* y) {
+	long r;
+	switch (LNUM_PAIR(x, y)) {
+		case LNUM_LL:
+			if (__builtin_sub_overflow(x->data.num, y->data.num, &r)) { break; }
+			x->data.num = r;
+			return LNUM_OK;
+		case LNUM_LD: lnum_widen(x); x->data.dec -= y->data.dec; return LNUM_OK;
+		case LNUM_DL: x->data.dec -= y->data.num; return LNUM_OK;
+		case LNUM_DD: x->data.dec -= y->data.dec; return LNUM_OK;
+	}
+	return lnum_big(x, y, lnum_sub, lbig_sub);
+}
+
+int lnum_mul(lval* x, lval* y) {
+	long r;
+	switch (LNUM_PAIR(x, y)) {
+		case LNUM_LL:
+			if (__builtin_mul_overflow(x->data.num, y->data.num, &r)) { break; }
+			x->data.num = r;
+			return LNUM_OK;
+		case LNUM_LD: lnum_widen(x); x->data.dec *= y->data.dec; return LNUM_OK;
+		case LNUM_DL: x->data.dec *= y->data.num; return LNUM_OK;
+		case LNUM_DD: x->data.dec *= y->data.dec; return LNUM_OK;
+	}
+	return lnum_big(x, y, lnum_mul, lbig_mul);
+}
+
+int lnum_div(lval* x, lval* y) {
+	if (lval_getData(y) == 0) { return LNUM_DIV_ZERO; }
+	switch (LNUM_PAIR(x, y)) {
+		case LNUM_LL:
+			// The smallest long divided by -1 does not fit
+			if (y->data.num == -1 && x->data.num == LONG_MIN) { break; }
+			x->data.num /= y->data.num;
+			return LNUM_OK;
+		case LNUM_LD: lnum_widen(x); x->data.dec /= y->data.dec; return LNUM_OK;
+		case LNUM_DL: x->data.dec /= y->data.num; return LNUM_OK;
+		case LNUM_DD: x->data.dec /= y->data.dec; return LNUM_OK;
+	}
+	return lnum_big(x, y, lnum_div, lbig_div);
+}
+
+// Integers take the sign of the dividend, as in C
+int lnum_mod(lval* x, lval* y) {
+	switch (LNUM_PAIR(x, y)) {
+		case LNUM_LL:
+			if (y->data.num == 0) { return LNUM_DIV_ZERO; }
+			x->data.num = y->data.num == -1 ? 0 : x->data.num % y->data.num;
+			return LNUM_OK;
+		case LNUM_LD: lnum_widen(x); x->data.dec = fmod(x->data.dec, y->data.dec); return LNUM_OK;
+		case LNUM_DL: x->data.dec = fmod(x->data.dec, y->data.num); return LNUM_OK;
+		case LNUM_DD: x->data.dec = fmod(x->data.dec, y->data.dec); return LNUM_OK;
+	}
+	if (y->type == LVAL_LONG && y->data.num == 0) { return LNUM_DIV_ZERO; }
+	return lnum_big(x, y, lnum_mod, lbig_mod);
+}
+
+// Exponentiation by squaring
+static int lnum_ipow(long b, long n, long* r) {
+	long acc = 1;
+	while (n > 0) {
+		if ((n & 1) && __builtin_mul_overflow(acc, b, &acc)) { return LNUM_OVERFLOW; }
+		n >>= 1;
+		if (n > 0 && __builtin_mul_overflow(b, b, &b)) { return LNUM_OVERFLOW; }
+	}
+	*r = acc;
+	return LNUM_OK;
+}
+
+// Integer powers, where only 0, 1 and -1 can take a huge exponent
+static int lnum_ipow_big(lval* x, lval* y) {
+	int sign = y->type == LVAL_LONG ? (y->data.num > 0) - (y->data.num < 0) : y->data.big->sign;
+	int unit = x->type == LVAL_LONG && x->data.num >= -1 && x->data.num <= 1;
+	if (sign == 0) { return lnum_set_big(x, lbig_long(1)) ? LNUM_OK : LNUM_NO_MEM; }
+
+	// Negative powers truncate towards zero, as dividing would
+	if (sign < 0 || unit) {
+		if (x->type == LVAL_LONG && x->data.num == 0) {
+			return sign < 0 ? LNUM_DIV_ZERO : LNUM_OK;
+		}
+		long odd = y->type == LVAL_LONG ? y->data.num & 1 : y->data.big->limb[0] & 1;
+		long r = !unit ? 0 : x->data.num == 1 || !odd ? 1 : -1;
+		return lnum_set_big(x, lbig_long(r)) ? LNUM_OK : LNUM_NO_MEM;
+	}
+	if (y->type == LVAL_BIGINT) { return LNUM_OVERFLOW; }
+
+	long r;
+	if (x->type == LVAL_LONG && lnum_ipow(x->data.num, y->data.num, &r) == LNUM_OK) {
+		x->data.num = r;
+		return LNUM_OK;
+	}
+	lbig* a = x->type == LVAL_BIGINT ? x->data.big : lbig_long(x->data.num);
+	lbig* p = a ? lbig_pow(a, y->data.num) : NULL;
+	if (x->type != LVAL_BIGINT) { lbig_free(a); }
+	return lnum_set_big(x, p) ? LNUM_OK : LNUM_NO_MEM;
+}
+
+int lnum_pow(lval* x, lval* y) {
+	switch (LNUM_PAIR(x, y)) {
+		case LNUM_LD: lnum_widen(x); x->data.dec = pow(x->data.dec, y->data.dec); return LNUM_OK;
+		case LNUM_DL: x->data.dec = pow(x->data.dec, y->data.num); return LNUM_OK;
+		case LNUM_DD: x->data.dec = pow(x->data.dec, y->data.dec); return LNUM_OK;
+	}
+	if (x->type == LVAL_DOUBLE || y->type == LVAL_DOUBLE) {
+		lnum_widen(x);
+		x->data.dec = pow(x->data.dec, lval_getData(y));
+		return LNUM_OK;
+	}
+	return lnum_ipow_big(x, y);
+}
+
+// Keep whichever is smaller, or larger; a double on either side makes
+// the result a double
+static int lnum_pick(lval* x, lval* y, int sign) {
+	if (LNUM_PAIR(x, y) == LNUM_LL) {
+		if ((y->data.num > x->data.num) - (y->data.num < x->data.num) == sign) {
+			x->data.num = y->data.num;
+		}
+		return LNUM_OK;
+	}
+
+	int c = lnum_cmp(y, x);
+	if (x->type == LVAL_DOUBLE || y->type == LVAL_DOUBLE) {
+		double d = c == sign ? lval_getData(y) : lval_getData(x);
+		if (x->type != LVAL_DOUBLE) { lnum_widen(x); }
+		x->data.dec = d;
+	} else if (c == sign) {
+		lbig* b = y->type == LVAL_BIGINT ? lbig_copy(y->data.big) : lbig_long(y->data.num);
+		if (!lnum_set_big(x, b)) { return LNUM_NO_MEM; }
+	}
+	return LNUM_OK;
+}
+
+int lnum_min(lval* x, lval* y) { return lnum_pick(x, y, -1); }
+
+int lnum_max(lval* x, lval* y) { return lnum_pick(x, y, 1); }
+
+lval* lnum_err(int status, char* op) {
+	if (status == LNUM_DIV_ZERO) { return lval_err("Divide by Zero"); }
+	if (status == LNUM_NO_MEM) { return lmem_err(); }
+	return lval_err("Integer overflow in '%s'.", op);
+}
+
+static lval* lnum_fold(int argc, lval** argv, char* op, lnum_kernel k) {
+	// Ensure all arguments are numbers
+	for (int i = 0; i < argc; i++) {
+		LASSERT_V(argc, argv, lnum_is(argv[i]),
+			"Function '%s' passed incorrect type for argument %i. Got %s, expected %s or %s.",
+			op, i, ltype_name(argv[i]->type), ltype_name(LVAL_LONG), ltype_name(LVAL_DOUBLE))
+	}
+	LASSERT_V(argc, argv, argc > 0, "Function '%s' passed no arguments.", op)
+
+	// A lone argument to '-' is negated
+	lval* x = argv[0];
+	if (argc == 1 && k == lnum_sub) {
+		int set = 1;
+		if (x->type == LVAL_DOUBLE) {
+			x->data.dec = -x->data.dec;
+		} else if (x->type == LVAL_BIGINT) {
+			set = lnum_set_big(x, lbig_neg(x->data.big));
+		} else if (x->data.num == LONG_MIN) {
+			lbig* b = lbig_long(x->data.num);
+			if (b) { b->sign = 1; }
+			set = lnum_set_big(x, b);
+		} else {
+			x->data.num = -x->data.num;
+		}
+		if (!set) {
+			lval_del_args(argc, argv);
+			return lmem_err();
+		}
+	}
+
+	for (int i = 1; i < argc; i++) {
+		int status = k(x, argv[i]);
+		if (status != LNUM_OK) {
+			lval_del_args(argc, argv);
+			return lnum_err(status, op);
+		}
+	}
+	lval_del_args(argc - 1, argv + 1);
+	return x;
+}
+
+lval* builtin_add_v(lenv* e, int argc, lval** argv) {
+  return lnum_fold(argc, argv, "+", lnum_add);
+}
+
+lval* builtin_sub_v(lenv* e, int argc, lval** argv) {
+  return lnum_fold(argc, argv, "-", lnum_sub);
+}
+
+lval* builtin_mul_v(lenv* e, int argc, lval** argv) {
+  return lnum_fold(argc, argv, "*", lnum_mul);
+}
+
+lval* builtin_div_v(lenv* e, int argc, lval** argv) {
+  return lnum_fold(argc, argv, "/", lnum_div);
+}
+
+lval* builtin_pow_v(lenv* e, int argc, lval** argv) {
+  return lnum_fold(argc, argv, "^", lnum_pow);
+}
+
+lval* builtin_mod_v(lenv* e, int argc, lval** argv) {
+  return lnum_fold(argc, argv, "%", lnum_mod);
+}
+
+lval* builtin_min_v(lenv* e, int argc, lval** argv) {
+  return lnum_fold(argc, argv, "min", lnum_min);
+}
+
+lval* builtin_max_v(lenv* e, int argc, lval** argv) {
+  return lnum_fold(argc, argv, "max", lnum_max);
+}
+
 lval* builtin_add(lenv* e, lval* a) {
-  return builtin_op(e, a, "+");
+  return lval_call_vector(e, builtin_add_v, a);
 }
 
 lval* builtin_sub(lenv* e, lval* a) {
-  return builtin_op(e, a, "-");
+  return lval_call_vector(e, builtin_sub_v, a);
 }
 
 lval* builtin_mul(lenv* e, lval* a) {
-  return builtin_op(e, a, "*");
+  return lval_call_vector(e, builtin_mul_v, a);
 }
 
 lval* builtin_div(lenv* e, lval* a) {
-  return builtin_op(e, a, "/");
+  return lval_call_vector(e, builtin_div_v, a);
 }
 
 lval* builtin_pow(lenv* e, lval* a) {
-  return builtin_op(e, a, "^");
+  return lval_call_vector(e, builtin_pow_v, a);
 }
 
 lval* builtin_mod(lenv* e, lval* a) {
-  return builtin_op(e, a, "%");
+  return lval_call_vector(e, builtin_mod_v, a);
 }
 
 lval* builtin_min(lenv* e, lval* a) {
-  return builtin_op(e, a, "min");
+  return lval_call_vector(e, builtin_min_v, a);
 }
 
 lval* builtin_max(lenv* e, lval* a) {
-  return builtin_op(e, a, "max");
+  return lval_call_vector(e, builtin_max_v, a);
 }
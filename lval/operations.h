@@ -17,7 +17,29 @@ lval* lval_eval(lenv* e, lval* v);
 void lval_del(lval* v);
 lval* lval_copy(lval* v);
 
-// Math libraries
+// Arithmetic kernels, combining the number y into the number x
+enum { LNUM_OK, LNUM_DIV_ZERO, LNUM_OVERFLOW, LNUM_NO_MEM };
+typedef int (*lnum_kernel)(lval* x, lval* y);
+int lnum_add(lval* x, lval* y);
+int lnum_sub(lval* x, lval* y);
+int lnum_mul(lval* x, lval* y);
+int lnum_div(lval* x, lval* y);
+int lnum_mod(lval* x, lval* y);
+int lnum_pow(lval* x, lval* y);
+int lnum_min(lval* x, lval* y);
+int lnum_max(lval* x, lval* y);
+// The error for a kernel that failed in operator op
+lval* lnum_err(int status, char* op);
+
+// Math libraries, over a list of arguments or a vector of them
+lval* builtin_add_v(lenv* e, int argc, lval** argv);
+lval* builtin_sub_v(lenv* e, int argc, lval** argv);
+lval* builtin_mul_v(lenv* e, int argc, lval** argv);
+lval* builtin_div_v(lenv* e, int argc, lval** argv);
+lval* builtin_pow_v(lenv* e, int argc, lval** argv);
+lval* builtin_mod_v(lenv* e, int argc, lval** argv);
+lval* builtin_min_v(lenv* e, int argc, lval** argv);
+lval* builtin_max_v(lenv* e, int argc, lval** argv);
 lval* builtin_add(lenv* e, lval* a);
 lval* builtin_sub(lenv* e, lval* a);
 lval* builtin_mul(lenv* e, lval* a);
@@ -0,0 +1,995 @@
+#include <string.h>
+#include "vm.h"
+#include "environment.h"
+#include "expressions.h"
+#include "conditionals.h"
+#include "operations.h"
+#include "numbers.h"
+#include "error.h"
+#include "memory.h"
+#include "bignum.h"
+#include "jit.h"
+#include "fold.h"
+
+int lvm_enabled = 1;
+
+// A stack entry is a value, or a builtin at the head of a call along
+// with its vector entry point if it has one
+typedef struct lvm_slot {
+	lval* v;
+	lbuiltin b;
+	lbuiltin_v vb;
+} lvm_slot;
+
+// Compiler state: the code being built and its stack height
+typedef struct lvm_compiler {
+	lcode* c;
+	int sp;
+} lvm_compiler;
+
+static void lvm_emit(lvm_compiler* k, int op) {
+	lcode* c = k->c;
+	if (c->count == c->capacity) {
+		c->capacity = c->capacity ? c->capacity * 2 : 16;
+		c->ops = (int*) lmem_xrealloc(LVAL_FUN, c->ops, sizeof(int) * c->capacity);
+	}
+	c->ops[c->count++] = op;
+}
+
+static void lvm_push(lvm_compiler* k, int n) {
+	k->sp += n;
+	if (k->sp > k->c->depth) { k->c->depth = k->sp; }
+}
+
+// Add a copy of x to the constants, as an S-Expression if asked
+static int lvm_const(lvm_compiler* k, lval* x, int sexpr) {
+	lcode* c = k->c;
+	c->consts = (lval**) lmem_xrealloc(LVAL_FUN, c->consts, sizeof(lval*) * (c->nconsts + 1));
+	lval* v = lval_copy(x);
+	if (sexpr && v->type == LVAL_QEXPR) { lval_retype(v, LVAL_SEXPR); }
+	c->consts[c->nconsts] = v;
+	return c->nconsts++;
+}
+
+// Emit a jump and return where its target goes
+static int lvm_jump(lvm_compiler* k, int op) {
+	lvm_emit(k, op);
+	lvm_emit(k, -1);
+	return k->c->count - 1;
+}
+
+static void lvm_patch(lvm_compiler* k, int at) { k->c->ops[at] = k->c->count; }
+
+// Keep x, a call within the code, for the tree walker to run in its place
+static int lvm_form(lvm_compiler* k, lval* x) {
+	lcode* c = k->c;
+	c->forms = (lval**) lmem_xrealloc(LVAL_FUN, c->forms, sizeof(lval*) * (c->nforms + 1));
+	c->forms[c->nforms] = x;
+	return c->nforms++;
+}
+
+// Push the head of call x, and return where the jump past the call
+// goes when the head turns out to be a macro
+static int lvm_compile_head(lvm_compiler* k, lval* x) {
+	lvm_emit(k, LOP_HEAD);
+	lvm_emit(k, lvm_const(k, x->cell[0], 0));
+	lvm_emit(k, lvm_form(k, x));
+	lvm_emit(k, -1);
+	return k->c->count - 1;
+}
+
+static void lvm_compile_expr(lvm_compiler* k, lval* x);
+static void lvm_compile_sexpr(lvm_compiler* k, lval* x, int tail);
+static void lvm_compile_written(lvm_compiler* k, lval* x, int tail);
+
+static int lvm_binop(char* sym) {
+	if (strcmp(sym, "+") == 0) { return LOP_ADD; }
+	if (strcmp(sym, "-") == 0) { return LOP_SUB; }
+	if (strcmp(sym, "*") == 0) { return LOP_MUL; }
+	if (strcmp(sym, "<") == 0) { return LOP_LT; }
+	if (strcmp(sym, ">") == 0) { return LOP_GT; }
+	if (strcmp(sym, "<=") == 0) { return LOP_LE; }
+	if (strcmp(sym, ">=") == 0) { return LOP_GE; }
+	if (strcmp(sym, "==") == 0) { return LOP_EQ; }
+	if (strcmp(sym, "!=") == 0) { return LOP_NE; }
+	return LOP_CALL;
+}
+
+// (if c {a} {b}) runs its branches inline when 'if' is still the builtin
+static void lvm_compile_if(lvm_compiler* k, lval* x, int tail) {
+	int sp = k->sp;
+	int ka = lvm_const(k, x->cell[2], 0);
+	int kb = lvm_const(k, x->cell[3], 0);
+
+	int past = lvm_compile_head(k, x);
+	int generic = lvm_jump(k, LOP_IF);
+
+	lvm_compile_expr(k, x->cell[1]);
+	lvm_emit(k, LOP_BRANCH);
+	lvm_emit(k, -1);
+	int other = k->c->count - 1;
+	lvm_emit(k, -1);
+	int done = k->c->count - 1;
+	lvm_emit(k, ka);
+	lvm_emit(k, kb);
+
+	k->sp = sp;
+	lvm_compile_sexpr(k, x->cell[2], tail);
+	int end1 = lvm_jump(k, LOP_JUMP);
+
+	lvm_patch(k, other);
+	k->sp = sp;
+	lvm_compile_sexpr(k, x->cell[3], tail);
+	int end2 = lvm_jump(k, LOP_JUMP);
+
+	// Otherwise it is an ordinary call
+	lvm_patch(k, generic);
+	k->sp = sp + 1;
+	lvm_compile_expr(k, x->cell[1]);
+	lvm_emit(k, LOP_CONST);
+	lvm_emit(k, ka);
+	lvm_push(k, 1);
+	lvm_emit(k, LOP_CONST);
+	lvm_emit(k, kb);
+	lvm_push(k, 1);
+	lvm_emit(k, LOP_CALL);
+	lvm_emit(k, 3);
+
+	lvm_patch(k, past);
+	lvm_patch(k, done);
+	lvm_patch(k, end1);
+	lvm_patch(k, end2);
+	k->sp = sp;
+	lvm_push(k, 1);
+}
+
+// Check the head pushed is the builtin of form op, otherwise jump to
+// where it is called as usual
+static int lvm_compile_form(lvm_compiler* k, int op) {
+	lvm_emit(k, LOP_FORM);
+	lvm_emit(k, op);
+	lvm_emit(k, -1);
+	return k->c->count - 1;
+}
+
+// The ordinary call of x, with its head already pushed
+static void lvm_compile_call(lvm_compiler* k, lval* x, int tail) {
+	for (int i = 1; i < x->count; i++) { lvm_compile_expr(k, x->cell[i]); }
+	lvm_emit(k, tail ? LOP_TAILCALL : LOP_CALL);
+	lvm_emit(k, x->count - 1);
+}
+
+// Push the constant x, which is taken
+static void lvm_compile_const(lvm_compiler* k, lval* x) {
+	lvm_emit(k, LOP_CONST);
+	lvm_emit(k, lvm_const(k, x, 0));
+	lvm_push(k, 1);
+	lval_del(x);
+}
+
+// (and ...) and (or ...) stop at the first argument deciding them
+static void lvm_compile_logic(lvm_compiler* k, lval* x, int op, int tail) {
+	int sp = k->sp;
+	int* ends = (int*) lmem_xalloc(LVAL_FUN, sizeof(int) * x->count);
+	int past = lvm_compile_head(k, x);
+	lvm_push(k, 1);
+	int generic = lvm_compile_form(k, op);
+
+	for (int i = 1; i < x->count; i++) {
+		k->sp = sp;
+		lvm_compile_expr(k, x->cell[i]);
+		lvm_emit(k, op);
+		lvm_emit(k, i - 1);
+		lvm_emit(k, -1);
+		ends[i] = k->c->count - 1;
+	}
+	k->sp = sp;
+	lvm_compile_const(k, lval_long(op == LOP_AND));
+	ends[0] = lvm_jump(k, LOP_JUMP);
+
+	lvm_patch(k, generic);
+	k->sp = sp + 1;
+	lvm_compile_call(k, x, tail);
+
+	lvm_patch(k, past);
+	for (int i = 0; i < x->count; i++) { lvm_patch(k, ends[i]); }
+	lmem_free(ends);
+	k->sp = sp;
+	lvm_push(k, 1);
+}
+
+// (cond {test body} ...) runs its tests and bodies inline
+static void lvm_compile_cond(lvm_compiler* k, lval* x, int tail) {
+	int sp = k->sp;
+	int* ends = (int*) lmem_xalloc(LVAL_FUN, sizeof(int) * x->count * 2);
+	int past = lvm_compile_head(k, x);
+	lvm_push(k, 1);
+	int generic = lvm_compile_form(k, LOP_COND);
+
+	for (int i = 1; i < x->count; i++) {
+		lval* test = x->cell[i]->cell[0];
+		lval* body = x->cell[i]->cell[1];
+		k->sp = sp;
+		lvm_compile_expr(k, test);
+		lvm_emit(k, LOP_COND);
+		lvm_emit(k, i - 1);
+		lvm_emit(k, -1);
+		int next = k->c->count - 1;
+		lvm_emit(k, -1);
+		ends[2 * i] = k->c->count - 1;
+
+		k->sp = sp;
+		if (body->type == LVAL_SEXPR) {
+			lvm_compile_sexpr(k, body, tail);
+		} else {
+			lvm_compile_expr(k, body);
+		}
+		ends[2 * i + 1] = lvm_jump(k, LOP_JUMP);
+		lvm_patch(k, next);
+	}
+	k->sp = sp;
+	lvm_compile_const(k, lval_sexpr());
+	ends[0] = lvm_jump(k, LOP_JUMP);
+
+	lvm_patch(k, generic);
+	k->sp = sp + 1;
+	lvm_compile_call(k, x, tail);
+
+	lvm_patch(k, past);
+	lvm_patch(k, ends[0]);
+	for (int i = 2; i < x->count * 2; i++) { lvm_patch(k, ends[i]); }
+	lmem_free(ends);
+	k->sp = sp;
+	lvm_push(k, 1);
+}
+
+// A call expanded ahead of time runs its expansion inline, as long as
+// the macro it called is still bound, and otherwise goes to the tree walker
+static void lvm_compile_macro(lvm_compiler* k, lval* x, int tail) {
+	int sp = k->sp;
+	lvm_emit(k, LOP_MACRO);
+	lvm_emit(k, lvm_const(k, x->cell[0], 0));
+	lvm_emit(k, x->macro);
+	lvm_emit(k, lvm_form(k, x));
+	lvm_emit(k, -1);
+	int past = k->c->count - 1;
+
+	lvm_compile_sexpr(k, x->expansion, tail);
+	lvm_patch(k, past);
+	k->sp = sp;
+	lvm_push(k, 1);
+}
+
+// Code folded ahead of time runs while the fold holds, and the code as
+// written after that
+static void lvm_compile_fold(lvm_compiler* k, lval* x, int tail) {
+	int sp = k->sp;
+	lvm_emit(k, LOP_FOLD);
+	lvm_emit(k, lvm_form(k, x));
+	lvm_emit(k, -1);
+	int stale = k->c->count - 1;
+
+	if (x->expansion->type == LVAL_SEXPR) {
+		lvm_compile_sexpr(k, x->expansion, tail);
+	} else {
+		lvm_compile_expr(k, x->expansion);
+	}
+	lvm_emit(k, LOP_JUMP);
+	lvm_emit(k, -1);
+	int past = k->c->count - 1;
+
+	lvm_patch(k, stale);
+	k->sp = sp;
+	lvm_compile_written(k, x, tail);
+	lvm_patch(k, past);
+	k->sp = sp;
+	lvm_push(k, 1);
+}
+
+// Code leaving what evaluating x as an S-Expression gives
+static void lvm_compile_sexpr(lvm_compiler* k, lval* x, int tail) {
+	// Empty and single symbol expressions keep their special cases
+	if (x->count == 0 || (x->count == 1 && x->cell[0]->type == LVAL_SYM)) {
+		lvm_emit(k, x->count ? LOP_EVAL : LOP_CONST);
+		lvm_emit(k, lvm_const(k, x, 1));
+		lvm_push(k, 1);
+		return;
+	}
+
+	// A single expression is evaluated again
+	if (x->count == 1) {
+		lvm_compile_expr(k, x->cell[0]);
+		lvm_emit(k, LOP_REEVAL);
+		return;
+	}
+
+	if (x->expansion && x->macro) {
+		lvm_compile_macro(k, x, tail);
+		return;
+	}
+	if (x->expansion) {
+		lvm_compile_fold(k, x, tail);
+		return;
+	}
+	lvm_compile_written(k, x, tail);
+}
+
+// Code for call x as written
+static void lvm_compile_written(lvm_compiler* k, lval* x, int tail) {
+	lval* head = x->cell[0];
+	if (head->type == LVAL_SYM && strcmp(head->data.sym, "if") == 0 && x->count == 4 &&
+		x->cell[2]->type == LVAL_QEXPR && x->cell[3]->type == LVAL_QEXPR) {
+		lvm_compile_if(k, x, tail);
+		return;
+	}
+	if (head->type == LVAL_SYM) {
+		char* sym = head->data.sym;
+		if (strcmp(sym, "and") == 0 || strcmp(sym, "&&") == 0) {
+			lvm_compile_logic(k, x, LOP_AND, tail);
+			return;
+		}
+		if (strcmp(sym, "or") == 0 || strcmp(sym, "||") == 0) {
+			lvm_compile_logic(k, x, LOP_OR, tail);
+			return;
+		}
+		if (strcmp(sym, "cond") == 0 && lval_cond_form(x)) {
+			lvm_compile_cond(k, x, tail);
+			return;
+		}
+	}
+
+	int sp = k->sp;
+	int op = tail ? LOP_TAILCALL : LOP_CALL;
+	int past = -1;
+	if (head->type == LVAL_SYM) {
+		past = lvm_compile_head(k, x);
+		lvm_push(k, 1);
+		int binop = x->count == 3 ? lvm_binop(head->data.sym) : LOP_CALL;
+		if (binop != LOP_CALL) { op = binop; }
+	} else {
+		lvm_compile_expr(k, head);
+	}
+
+	// Comparisons of two symbols look at their values in place
+	if ((op == LOP_EQ || op == LOP_NE) &&
+		x->cell[1]->type == LVAL_SYM && x->cell[2]->type == LVAL_SYM) {
+		lvm_emit(k, op == LOP_EQ ? LOP_EQSYM : LOP_NESYM);
+		lvm_emit(k, lvm_const(k, x->cell[1], 0));
+		lvm_emit(k, lvm_const(k, x->cell[2], 0));
+		lvm_push(k, 2);
+		lvm_patch(k, past);
+		k->sp = sp;
+		lvm_push(k, 1);
+		return;
+	}
+
+	for (int i = 1; i < x->count; i++) { lvm_compile_expr(k, x->cell[i]); }
+	lvm_emit(k, op);
+	if (op == LOP_CALL || op == LOP_TAILCALL) { lvm_emit(k, x->count - 1); }
+	if (past != -1) { lvm_patch(k, past); }
+
+	k->sp = sp;
+	lvm_push(k, 1);
+}
+
+// Code leaving what evaluating x gives
+static void lvm_compile_expr(lvm_compiler* k, lval* x) {
+	switch (x->type) {
+		case LVAL_SYM:
+			lvm_emit(k, x->depth == 0 ? LOP_LOCAL : LOP_GLOBAL);
+			lvm_emit(k, lvm_const(k, x, 0));
+			lvm_push(k, 1);
+			break;
+		case LVAL_SEXPR: lvm_compile_sexpr(k, x, 0); break;
+		default:
+			lvm_emit(k, LOP_CONST);
+			lvm_emit(k, lvm_const(k, x, 0));
+			lvm_push(k, 1);
+	}
+}
+
+// The body runs as an S-Expression, just as 'eval' would. The calls
+// the code keeps point into it, so it has to stay put
+static lcode* lvm_compile(lval* body, lparams* p) {
+	lcode* c = (lcode*) lmem_xalloc(LVAL_FUN, sizeof(lcode));
+	memset(c, 0, sizeof(lcode));
+	c->refs = 1;
+	c->params = p;
+	c->body = p ? NULL : body;
+
+	// Code is kept for later forms, so its constants may not be refused
+	lvm_compiler k = { c, 0 };
+	lmem_exempt(1);
+	lvm_compile_sexpr(&k, body, 1);
+	lvm_emit(&k, LOP_RETURN);
+	lmem_exempt(0);
+	return c;
+}
+
+lcode* lvm_code(lval* f) {
+	lfun* fn = f->fun;
+	if (fn->code == NULL) { fn->code = lvm_compile(lval_body(f), lparams_retain(fn->params)); }
+	return fn->code;
+}
+
+lcode* lvm_retain(lcode* c) {
+	if (c) { c->refs++; }
+	return c;
+}
+
+void lvm_release(lcode* c) {
+	if (c == NULL || --c->refs > 0) { return; }
+	for (int i = 0; i < c->nconsts; i++) { lval_del(c->consts[i]); }
+	lmem_free(c->consts);
+	lmem_free(c->ops);
+	lmem_free(c->forms);
+	lparams_release(c->params);
+	if (c->body) { lval_del(c->body); }
+	ljit_free(c->jit);
+	lmem_free(c);
+}
+
+// Copy of a value, as evaluating a symbol bound to it gives
+static lval* lvm_value(lval* x, lval* k) {
+	if (lmem_exhausted()) { return lmem_err(); }
+	if (x == NULL) { return lval_err("Unbounded symbol %s", k->data.sym); }
+
+	// Lambdas passed around share the code compiled for the binding
+	if (x->type == LVAL_FUN && !x->fun->builtin) { lvm_code(x); }
+	return lval_copy(x);
+}
+
+// Formals of the running lambda are loaded in place
+static lval* lvm_local(lenv* e, lval* k) {
+	int i = k->slot - e->bound;
+	if (e->owner == k->owner && i >= 0) { return e->cells[i]->val; }
+	return lenv_lookup(e, k);
+}
+
+lval* lvm_pin(lval* f) {
+	lvm_code(f);
+	return lval_copy(f);
+}
+
+// The head of a call to k, bound to x
+static lvm_slot lvm_head(lval* x, lval* k) {
+	lvm_slot s = { NULL, NULL, NULL };
+	if (x && x->type == LVAL_FUN && x->fun->builtin) {
+		s.b = x->fun->builtin;
+		s.vb = x->fun->vbuiltin;
+	} else if (x && x->type == LVAL_FUN && !x->fun->memo && !lmem_exhausted()) {
+		s.v = lvm_pin(x);
+	} else {
+		s.v = lvm_value(x, k);
+	}
+	return s;
+}
+
+// Discard results built past the heap budget, and errors raised on
+// the way for what was refused
+static lval* lvm_result(lval* r) {
+	if (lmem_exhausted()) {
+		lval_del(r);
+		return lmem_err();
+	}
+	return r;
+}
+
+// Apply the head in s[0] to the n values after it
+static lval* lvm_call(lenv* e, lvm_slot* s, int n) {
+	// The first error in evaluation order is the result
+	for (int i = s[0].b ? 1 : 0; i <= n; i++) {
+		if (s[i].v->type == LVAL_ERR) {
+			lval* err = s[i].v;
+			for (int j = s[0].b ? 1 : 0; j <= n; j++) {
+				if (j != i) { lval_del(s[j].v); }
+			}
+			return err;
+		}
+	}
+
+	// Short calls gather the arguments on the C stack
+	if (s[0].vb && n <= LVAL_ARGS_MAX) {
+		lval* argv[LVAL_ARGS_MAX];
+		for (int i = 0; i < n; i++) { argv[i] = s[i + 1].v; }
+		return lvm_result(s[0].vb(e, n, argv));
+	}
+
+	lval* result;
+	lval* a = lval_sexpr();
+	a->count = n;
+	a->cell = (lval**) lmem_xalloc(LVAL_SEXPR, sizeof(lval*) * n);
+	for (int i = 0; i < n; i++) { a->cell[i] = s[i + 1].v; }
+
+	if (s[0].b) {
+		result = s[0].b(e, a);
+	} else {
+		lval* f = s[0].v;
+		if (f->type != LVAL_FUN) {
+			lval* err = lval_err(
+				"S-Experssion starts with incorrect type. "
+				"Got %s, Expected %s.",
+				ltype_name(f->type), ltype_name(LVAL_FUN));
+			lval_del(f); lval_del(a);
+			return err;
+		}
+		result = lval_call(e, f, a);
+		lval_del(f);
+	}
+	return lvm_result(result);
+}
+
+static lbuiltin lvm_builtins[] = {
+	[LOP_ADD] = builtin_add, [LOP_SUB] = builtin_sub, [LOP_MUL] = builtin_mul,
+	[LOP_LT] = builtin_lt, [LOP_GT] = builtin_gt, [LOP_LE] = builtin_le,
+	[LOP_GE] = builtin_ge, [LOP_EQ] = builtin_eq, [LOP_NE] = builtin_ne,
+	[LOP_AND] = builtin_and, [LOP_OR] = builtin_or, [LOP_COND] = builtin_cond
+};
+
+// Two numbers given to a known builtin are worked out in place by the
+// kernel behind it
+static int lvm_binop_fast(int op, lvm_slot* s) {
+	if (s[0].b != lvm_builtins[op]) { return 0; }
+	lval* x = s[1].v;
+	lval* y = s[2].v;
+	if (!lnum_is(x) || !lnum_is(y)) { return 0; }
+
+	// Overflow is left for the builtin to report
+	int r = 0;
+	switch (op) {
+		case LOP_ADD: if (lnum_add(x, y) != LNUM_OK) { return 0; } break;
+		case LOP_SUB: if (lnum_sub(x, y) != LNUM_OK) { return 0; } break;
+		case LOP_MUL: if (lnum_mul(x, y) != LNUM_OK) { return 0; } break;
+		case LOP_LT: r = lnum_lt(x, y); break;
+		case LOP_GT: r = lnum_gt(x, y); break;
+		case LOP_LE: r = lnum_le(x, y); break;
+		case LOP_GE: r = lnum_ge(x, y); break;
+		case LOP_EQ: r = lval_eq(x, y); break;
+		case LOP_NE: r = !lval_eq(x, y); break;
+	}
+
+	// Comparisons leave a long
+	if (op >= LOP_LT) {
+		if (x->type == LVAL_BIGINT) { lbig_free(x->data.big); }
+		if (x->type != LVAL_LONG) { lval_retype(x, LVAL_LONG); }
+		x->data.num = r;
+	}
+	lval_del(y);
+	return 1;
+}
+
+/*
+    Calls between lambdas do not recurse in C. Each running body has an
+    activation record and its values on stacks of their own, grown on
+    the heap, so the depth of recursion is bounded by lvm_max_depth only
+*/
+typedef struct lvm_act {
+	lenv* e;
+	lcode* c;
+	// Function called, whose formals the frame borrows
+	lval* f;
+	// Whether the frame is popped when the body returns
+	int owner;
+	// Where to carry on in the body, and where its values start
+	int pc;
+	int base;
+} lvm_act;
+
+// One pair of stacks for every session, as only one form runs at a time
+static lvm_act* lvm_acts = NULL;
+static int lvm_nacts = 0;
+static int lvm_acts_size = 0;
+
+static lvm_slot* lvm_values = NULL;
+static int lvm_top = 0;
+static int lvm_values_size = 0;
+
+// Sizes the stacks start at, and go back to once nothing runs on them
+#define LVM_ACTS_SIZE 64
+#define LVM_VALUES_SIZE 256
+
+long lvm_depth = 0;
+long lvm_max_depth = LVM_MAX_DEPTH;
+
+lval* lvm_depth_err(void) {
+	return lval_err("Maximum recursion depth of %li exceeded.", lvm_max_depth);
+}
+
+// Make room for n more values
+static void lvm_reserve(int n) {
+	if (lvm_top + n <= lvm_values_size) { return; }
+	int size = lvm_values_size ? lvm_values_size : LVM_VALUES_SIZE;
+	while (size < lvm_top + n) { size *= 2; }
+	lvm_values = (lvm_slot*) lmem_xrealloc(LMEM_ENV, lvm_values, sizeof(lvm_slot) * size);
+	lvm_values_size = size;
+}
+
+static void lvm_push_value(lval* v) {
+	lvm_values[lvm_top].v = v;
+	lvm_values[lvm_top].b = NULL;
+	lvm_values[lvm_top].vb = NULL;
+	lvm_top++;
+}
+
+// Start running c in e, unless that goes past the recursion limit
+static int lvm_enter(lenv* e, lcode* c, lval* f, int owner) {
+	if (lvm_depth >= lvm_max_depth) { return 0; }
+	if (lvm_nacts == lvm_acts_size) {
+		lvm_acts_size = lvm_acts_size ? lvm_acts_size * 2 : LVM_ACTS_SIZE;
+		lvm_acts = (lvm_act*) lmem_xrealloc(LMEM_ENV, lvm_acts, sizeof(lvm_act) * lvm_acts_size);
+	}
+	lvm_act* a = &lvm_acts[lvm_nacts++];
+	a->e = e;
+	a->c = c;
+	a->f = f;
+	a->owner = owner;
+	a->pc = 0;
+	a->base = lvm_top;
+	lvm_reserve(c->depth);
+	lvm_depth++;
+	return 1;
+}
+
+static void lvm_leave(void) {
+	lvm_act* a = &lvm_acts[--lvm_nacts];
+	lvm_top = a->base;
+	if (a->owner && a->e) { lenv_pop(a->e); }
+	if (a->f) { lval_del(a->f); }
+	lvm_release(a->c);
+	lvm_depth--;
+}
+
+// A builtin applied to atoms cannot call back into a body, and walking
+// it once is cheaper than compiling it
+static int lvm_leaf(lenv* e, lval* x) {
+	if (x->count == 0) { return 1; }
+	for (int i = 0; i < x->count; i++) {
+		if (x->cell[i]->type == LVAL_SEXPR || x->cell[i]->type == LVAL_QEXPR) { return 0; }
+	}
+	lval* h = x->cell[0]->type == LVAL_SYM ? lenv_lookup(e, x->cell[0]) : x->cell[0];
+	return h && h->type == LVAL_FUN && h->fun->builtin;
+}
+
+// Ways lvm_start can deal with a call
+enum { LVM_GENERIC, LVM_STARTED, LVM_RESULT, LVM_RETURN };
+
+// A call to a lambda, or to 'eval' with a Q-Expression, starts its body
+// on the stacks. In tail position the body takes over the activation
+// making the call, and a lambda its slot on the frame stack too
+static int lvm_start(int s, int n, int tail, lval** r) {
+	lvm_slot* v = &lvm_values[s];
+	for (int i = v[0].b ? 1 : 0; i <= n; i++) {
+		if (v[i].v->type == LVAL_ERR) { return LVM_GENERIC; }
+	}
+	if (lmem_exhausted()) { return LVM_GENERIC; }
+
+	lvm_act* a = &lvm_acts[lvm_nacts - 1];
+	if (v[0].b == builtin_eval && n == 1 && v[1].v->type == LVAL_QEXPR &&
+		!lvm_leaf(a->e, v[1].v)) {
+		// The code keeps the Q-Expression it was built from
+		lcode* code = lvm_compile(v[1].v, NULL);
+		lvm_top = s;
+		if (tail) {
+			lvm_release(a->c);
+			a->c = code;
+			a->pc = 0;
+			lvm_reserve(code->depth);
+		} else if (!lvm_enter(a->e, code, NULL, 0)) {
+			lvm_release(code);
+			*r = lvm_depth_err();
+			return LVM_RESULT;
+		}
+		return LVM_STARTED;
+	}
+
+	lval* f = v[0].v;
+	// Memoized functions are called through their table, and macros turned away
+	if (v[0].b || f->type != LVAL_FUN || f->fun->builtin || f->fun->memo || f->fun->macro) { return LVM_GENERIC; }
+
+	lval* args = lval_sexpr();
+	args->count = n;
+	args->cell = (lval**) lmem_xalloc(LVAL_SEXPR, sizeof(lval*) * n);
+	for (int i = 0; i < n; i++) { args->cell[i] = v[i + 1].v; }
+	lvm_top = s;
+
+	// Hot bodies may run natively, which takes no activation at all
+	lvm_code(f);
+	if (ljit_call(f, args->cell, n, r)) {
+		lval_del(f);
+		lval_del(args);
+		return LVM_RESULT;
+	}
+
+	if (tail && a->owner) {
+		// The arguments are values of their own, so the frame can go first
+		lenv* session = a->e->session;
+		lenv_pop(a->e);
+		if (a->f) { lval_del(a->f); }
+		a->f = f;
+		a->e = lval_call_frame(session ? session : f->fun->env, f, args, r);
+		if (a->e == NULL) { return LVM_RETURN; }
+
+		lvm_release(a->c);
+		a->c = lvm_retain(f->fun->code);
+		a->pc = 0;
+		lvm_reserve(a->c->depth);
+		return LVM_STARTED;
+	}
+
+	if (lvm_depth >= lvm_max_depth) {
+		lval_del(f);
+		lval_del(args);
+		*r = lvm_depth_err();
+		return LVM_RESULT;
+	}
+
+	lenv* frame = lval_call_frame(a->e, f, args, r);
+	if (frame == NULL) {
+		lval_del(f);
+		return LVM_RESULT;
+	}
+	lvm_enter(frame, lvm_retain(f->fun->code), f, 1);
+	return LVM_STARTED;
+}
+
+// Run until the activation at floor returns
+static lval* lvm_run(int floor) {
+	lvm_act* a = &lvm_acts[lvm_nacts - 1];
+	lenv* e = a->e;
+	lcode* c = a->c;
+	int pc = a->pc;
+
+	while (1) {
+		int op = c->ops[pc++];
+		switch (op) {
+			case LOP_CONST: {
+				lval* x = c->consts[c->ops[pc++]];
+				lvm_push_value(lmem_exhausted() ? lmem_err() : lval_copy(x));
+				break;
+			}
+
+			case LOP_LOCAL: {
+				lval* k = c->consts[c->ops[pc++]];
+				lvm_push_value(lvm_value(lvm_local(e, k), k));
+				break;
+			}
+
+			case LOP_GLOBAL: {
+				lval* k = c->consts[c->ops[pc++]];
+				lvm_push_value(lvm_value(lenv_lookup(e, k), k));
+				break;
+			}
+
+			case LOP_HEAD: {
+				lval* k = c->consts[c->ops[pc]];
+				lval* x = lenv_lookup(e, k);
+				if (x && x->type == LVAL_FUN && x->fun->macro) {
+					lvm_push_value(lval_run(e, c->forms[c->ops[pc + 1]], 0));
+					pc = c->ops[pc + 2];
+					break;
+				}
+				lvm_values[lvm_top++] = lvm_head(x, k);
+				pc += 3;
+				break;
+			}
+
+			case LOP_FOLD:
+				pc = LFOLD_HOLDS(c->forms[c->ops[pc]]) ? pc + 2 : c->ops[pc + 1];
+				break;
+
+			case LOP_MACRO: {
+				lval* x = lenv_lookup(e, c->consts[c->ops[pc]]);
+				if (x && x->type == LVAL_FUN && x->fun->macro == c->ops[pc + 1]) {
+					pc += 4;
+					break;
+				}
+				lvm_push_value(lval_run(e, c->forms[c->ops[pc + 2]], 0));
+				pc = c->ops[pc + 3];
+				break;
+			}
+
+			case LOP_CALL:
+			case LOP_TAILCALL: {
+				int n = c->ops[pc++];
+				int s = lvm_top - n - 1;
+				lval* r;
+				lvm_acts[lvm_nacts - 1].pc = pc;
+
+				switch (lvm_start(s, n, op == LOP_TAILCALL, &r)) {
+					case LVM_GENERIC:
+						r = lvm_call(e, &lvm_values[s], n);
+						lvm_top = s;
+						lvm_push_value(r);
+						break;
+
+					case LVM_RESULT:
+						lvm_push_value(lvm_result(r));
+						break;
+
+					case LVM_RETURN:
+						// A tail call ended before its body ran
+						lvm_leave();
+						if (lvm_nacts == floor) { return r; }
+						lvm_push_value(lvm_result(r));
+						/* fall through */
+					case LVM_STARTED:
+						a = &lvm_acts[lvm_nacts - 1];
+						e = a->e;
+						c = a->c;
+						pc = a->pc;
+						break;
+				}
+				break;
+			}
+
+			case LOP_ADD: case LOP_SUB: case LOP_MUL:
+			case LOP_LT: case LOP_GT: case LOP_LE:
+			case LOP_GE: case LOP_EQ: case LOP_NE: {
+				int s = lvm_top - 3;
+				lval* r = lvm_binop_fast(op, &lvm_values[s])
+					? lvm_values[s + 1].v : lvm_call(e, &lvm_values[s], 2);
+				lvm_top = s;
+				lvm_push_value(r);
+				break;
+			}
+
+			case LOP_EQSYM:
+			case LOP_NESYM: {
+				lval* ka = c->consts[c->ops[pc++]];
+				lval* kb = c->consts[c->ops[pc++]];
+				lval* x = ka->depth == 0 ? lvm_local(e, ka) : lenv_lookup(e, ka);
+				lval* y = kb->depth == 0 ? lvm_local(e, kb) : lenv_lookup(e, kb);
+				int eq = op == LOP_EQSYM;
+				int s = lvm_top - 1;
+				if (lvm_values[s].b == (eq ? builtin_eq : builtin_ne) && x && y &&
+					x->type != LVAL_ERR && y->type != LVAL_ERR && !lmem_exhausted()) {
+					lvm_top = s;
+					lvm_push_value(lval_long(lval_eq(x, y) == eq));
+					break;
+				}
+
+				// Otherwise the call is made on copies as usual
+				lvm_push_value(lvm_value(x, ka));
+				lvm_push_value(lvm_value(y, kb));
+				lval* r = lvm_call(e, &lvm_values[s], 2);
+				lvm_top = s;
+				lvm_push_value(r);
+				break;
+			}
+
+			case LOP_EVAL: {
+				lval* r = lval_run(e, c->consts[c->ops[pc++]], 0);
+				lvm_push_value(r);
+				break;
+			}
+
+			case LOP_REEVAL: {
+				lval* r = lval_eval(e, lvm_values[lvm_top - 1].v);
+				lvm_values[lvm_top - 1].v = r;
+				break;
+			}
+
+			case LOP_IF:
+				if (lvm_values[lvm_top - 1].b == builtin_if) {
+					lvm_top--;
+					pc++;
+				} else {
+					pc = c->ops[pc];
+				}
+				break;
+
+			case LOP_BRANCH: {
+				lval* x = lvm_values[lvm_top - 1].v;
+				if (x->type == LVAL_LONG) {
+					lvm_top--;
+					pc = x->data.num ? pc + 4 : c->ops[pc];
+					lval_del(x);
+					break;
+				}
+
+				// Errors and conditions of the wrong type end up as the result
+				if (x->type != LVAL_ERR) {
+					lval* a = lval_add(lval_sexpr(), x);
+					lval_add(a, lval_copy(c->consts[c->ops[pc + 2]]));
+					lval_add(a, lval_copy(c->consts[c->ops[pc + 3]]));
+					lval* r = builtin_if(e, a);
+					lvm_values[lvm_top - 1].v = r;
+				}
+				pc = c->ops[pc + 1];
+				break;
+			}
+
+			case LOP_FORM:
+				if (lvm_values[lvm_top - 1].b == lvm_builtins[c->ops[pc]]) {
+					lvm_top--;
+					pc += 2;
+				} else {
+					pc = c->ops[pc + 1];
+				}
+				break;
+
+			case LOP_AND:
+			case LOP_OR: {
+				lval* r = lval_logic_step(lvm_builtins[op], lvm_values[lvm_top - 1].v, c->ops[pc]);
+				if (r) {
+					lvm_values[lvm_top - 1].v = r;
+					pc = c->ops[pc + 1];
+				} else {
+					lvm_top--;
+					pc += 2;
+				}
+				break;
+			}
+
+			case LOP_COND: {
+				lval* x = lval_cond_test(lvm_values[lvm_top - 1].v, c->ops[pc]);
+				if (x->type == LVAL_ERR) {
+					lvm_values[lvm_top - 1].v = x;
+					pc = c->ops[pc + 2];
+					break;
+				}
+				lvm_top--;
+				pc = x->data.num ? pc + 3 : c->ops[pc + 1];
+				lval_del(x);
+				break;
+			}
+
+			case LOP_JUMP:
+				pc = c->ops[pc];
+				break;
+
+			case LOP_RETURN: {
+				lval* r = lvm_values[lvm_top - 1].v;
+				lvm_leave();
+				if (lvm_nacts == floor) { return r; }
+
+				// Back in the caller, with the result of its call
+				lvm_push_value(lvm_result(r));
+				a = &lvm_acts[lvm_nacts - 1];
+				e = a->e;
+				c = a->c;
+				pc = a->pc;
+				break;
+			}
+		}
+	}
+}
+
+// Give back what a deep recursion grew the stacks to
+static void lvm_shrink(void) {
+	if (lvm_acts_size > LVM_ACTS_SIZE) {
+		lvm_acts = (lvm_act*) lmem_xrealloc(LMEM_ENV, lvm_acts, sizeof(lvm_act) * LVM_ACTS_SIZE);
+		lvm_acts_size = LVM_ACTS_SIZE;
+	}
+	if (lvm_values_size > LVM_VALUES_SIZE) {
+		lvm_values = (lvm_slot*) lmem_xrealloc(LMEM_ENV, lvm_values, sizeof(lvm_slot) * LVM_VALUES_SIZE);
+		lvm_values_size = LVM_VALUES_SIZE;
+	}
+}
+
+lval* lvm_exec(lenv* e, lcode* c) {
+	int floor = lvm_nacts;
+	if (!lvm_enter(e, lvm_retain(c), NULL, 1)) {
+		lvm_release(c);
+		lenv_pop(e);
+		return lvm_depth_err();
+	}
+	lval* r = lvm_run(floor);
+
+	// The outermost call is over, whether it returned or unwound an error
+	if (lvm_nacts == 0) { lvm_shrink(); }
+	return r;
+}
+
+lval* builtin_max_depth(lenv* e, lval* a) {
+	LASSERT_NUM("max-depth", a, 1)
+	LASSERT_TYPE("max-depth", a, 0, LVAL_LONG)
+	LASSERT(a, a->cell[0]->data.num > 0,
+		"Function 'max-depth' passed a limit below one.")
+
+	// Hand back the previous limit
+	lval* x = lval_long(lvm_max_depth);
+	lvm_max_depth = a->cell[0]->data.num;
+	lval_del(a);
+	return x;
+}
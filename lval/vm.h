@@ -0,0 +1,116 @@
+#ifndef LVAL_VM
+#define LVAL_VM
+#include "base.h"
+
+/*
+    Bytecode virtual machine
+    The body of a lambda is compiled on its first call into a flat list
+    of instructions over a value stack. Running it gives the same result
+    and errors as handing a copy of the body to the tree walker, without
+    copying the body or reexamining its shape on every call.
+    Forms that only the tree walker knows how to run are left to it.
+*/
+enum {
+    // Push a copy of constant a
+    LOP_CONST,
+    // Push the value of symbol a, bound in the current frame or further out
+    LOP_LOCAL,
+    LOP_GLOBAL,
+    // Push the head of a call to symbol a: a builtin or its value. A
+    // macro has the tree walker run call b instead, and jumps to c with
+    // the result
+    LOP_HEAD,
+    // Carry on into the expansion of a call to symbol a while it is
+    // bound to macro number b, otherwise run call c with the tree walker
+    // and jump to d with the result
+    LOP_MACRO,
+    // Carry on into the code call a was folded to while it holds,
+    // otherwise jump to b for the code as written
+    LOP_FOLD,
+    // Call the head below the top a values with them as arguments,
+    // in place of the running body when the call is its last step
+    LOP_CALL,
+    LOP_TAILCALL,
+    // Two argument calls to the arithmetic and comparison builtins
+    LOP_ADD, LOP_SUB, LOP_MUL,
+    LOP_LT, LOP_GT, LOP_LE, LOP_GE, LOP_EQ, LOP_NE,
+    // The same for '==' and '!=' on symbols a and b, comparing their
+    // values where they are bound rather than copies of them
+    LOP_EQSYM, LOP_NESYM,
+    // Evaluate constant a, or the value on top, with the tree walker
+    LOP_EVAL,
+    LOP_REEVAL,
+    // Drop the head if it is the 'if' builtin, otherwise jump to a
+    LOP_IF,
+    // Pop a condition: jump to a when false, to b with the result of
+    // 'if' on constants c and d when it is not a number
+    LOP_BRANCH,
+    // Drop the head if it is the builtin of form a, otherwise jump to b
+    LOP_FORM,
+    // Pop argument a of 'and' or 'or', and jump to b with the result
+    // when it decides it
+    LOP_AND, LOP_OR,
+    // Pop the test of clause a of 'cond': jump to b when false, to c
+    // with the error when it is not a number
+    LOP_COND,
+    LOP_JUMP,
+    LOP_RETURN
+};
+
+struct lcode {
+    // Shared by every copy of the function
+    int refs;
+
+    int* ops;
+    int count;
+    int capacity;
+
+    lval** consts;
+    int nconsts;
+
+    // Deepest the value stack gets
+    int depth;
+
+    // Code of a lambda keeps its formals, and with them the body it was
+    // built from. Other code has its own copy of what it was built from
+    lparams* params;
+    lval* body;
+
+    // Calls in the body that the tree walker may be asked to run
+    lval** forms;
+    int nforms;
+
+    // Calls counted towards making the body hot, and its native code
+    long calls;
+    ljit* jit;
+};
+
+// Whether lambdas are run by the virtual machine or the tree walker
+extern int lvm_enabled;
+
+// Code of lambda f, compiled on first use and shared by its copies
+lcode* lvm_code(lval* f);
+lcode* lvm_retain(lcode* c);
+void lvm_release(lcode* c);
+
+// Run compiled code in the frame of a call, and pop the frame
+// Tail calls replace both, so this is the last frame they ran in
+lval* lvm_exec(lenv* e, lcode* c);
+
+// A copy of lambda f about to be called, with its code ready
+lval* lvm_pin(lval* f);
+
+/*
+    Recursion limit
+    Lambda calls in progress, counted by both evaluators. Going past the
+    limit is an error rather than a crash; the machine keeps calls on the
+    heap and can go as deep as the limit allows.
+*/
+#define LVM_MAX_DEPTH 1000000
+extern long lvm_depth;
+extern long lvm_max_depth;
+lval* lvm_depth_err(void);
+
+lval* builtin_max_depth(lenv* e, lval* a);
+
+#endif
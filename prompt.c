@@ -31,9 +31,6 @@ void add_history(char* unused) {}
 #include <editline/readline.h>
 #endif
 
-double max(double x, double y);
-double min(double x, double y);
-lval* builtin_op(lenv* e, lval* v, char* op);
 
 
 int main (int argc, char** argv) {
@@ -53,7 +50,7 @@ int main (int argc, char** argv) {
 			"number   : /[0-9]+/;						                     "
 			"long     : /-?[0-9]+/;	                    	                 "
 			"double   : <long> '.' <number>;                                 "
-			"symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/;                    "
+			"symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%^]+/;                  "
 			"sexpr    : '(' <expr>* ')';					                 "
 			"qexpr    : '{' <expr>* '}';                                     "
 			"expr     : (<double> | <long>) | <symbol> | <sexpr> | <qexpr>;  "
@@ -65,8 +62,36 @@ int main (int argc, char** argv) {
 	puts("Lispy Version 0.0.0.0.1");
 	puts("Press Ctrl+c to Exit\n");
 
-	lenv* e = lenv_new();
-	lenv_add_builtins(e);
+	// Command line options
+	long limit = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--heap-limit") == 0 && i + 1 < argc) {
+			limit = strtol(argv[++i], NULL, 10);
+		}
+		// Choose between the bytecode machine and the tree walker
+		if (strcmp(argv[i], "--eval") == 0 && i + 1 < argc) {
+			lvm_enabled = strcmp(argv[++i], "tree") != 0;
+		}
+		if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) {
+			long n = strtol(argv[++i], NULL, 10);
+			if (n > 0) { lvm_max_depth = n; }
+		}
+		// Native code for hot lambdas can be turned off
+		if (strcmp(argv[i], "--jit") == 0 && i + 1 < argc) {
+			ljit_enabled = strcmp(argv[++i], "off") != 0;
+		}
+		// Definitions can share equal subtrees
+		if (strcmp(argv[i], "--hashcons") == 0 && i + 1 < argc) {
+			lhcons_enabled = strcmp(argv[++i], "off") != 0;
+		}
+	}
+
+	// The builtins live in a frozen base shared by the session layered on it
+	lenv* base = lenv_new();
+	lenv_add_builtins(base);
+	lenv_freeze(base);
+	lenv* e = lenv_session(base);
+	lmem_set_limit(e->budget, limit);
 
 	// In a never ending loop
 	while (1) {
@@ -81,7 +106,9 @@ int main (int argc, char** argv) {
 		if (mpc_parse("<stdin>", input, Lispy, &r)) {
 			// Evualuate the expression and print its output
 			// lval result = eval(r.output);
+			lmem_form_begin(e->budget);
 			lval* result = lval_eval(e, lval_read(r.output));
+			lmem_form_end();
 			lval_println(result);
 			// mpc_ast_print(r.output);
 			mpc_ast_delete(r.output);
@@ -101,64 +128,8 @@ int main (int argc, char** argv) {
 	}
 
 	lenv_del(e);
+	lenv_del(base);
 
 	mpc_cleanup(8, Number, Long, Double, Symbol, Sexpr, Qexpr, Expr, Lispy);
 	return 0;
 }
-
-
-double max(double x, double y) {
-	if (x > y) {
-		return x;
-	}
-	return y;
-}
-
-double min(double x, double y) {
-	if (x < y) {
-		return x;
-	}
-	return y;
-}
-
-lval* builtin_op(lenv* e, lval* a, char* op) {
-	// Ensure all arguments are numbers
-	for (int i = 0; i < a->count; i++) {
-		if (a->cell[i]->type != LVAL_LONG && a->cell[i]->type != LVAL_DOUBLE) {
-			lval* x = lval_err("Function '%s' passed incorrect type for argument %i. Got %s, expected %s or %s.", 
-				op, i, ltype_name(a->cell[i]->type), ltype_name(LVAL_LONG), ltype_name(LVAL_DOUBLE)); 
-			lval_del(a);
-			return x;
-		}
-	}
-
-	// Pop the first element
-	lval* x = lval_pop(a, 0);
-
-	// If there are no other arguments then perform unary operation
-	if (a->count == 0) {
-		if (strcmp(op, "-") == 0) { lval_updateData(x, -1 * lval_getData(x), x->type); }
-	}
-
-	while (a->count > 0) {
-		// Pop the next element
-		lval* y = lval_pop(a, 0);
-		int resultType = (x->type == LVAL_LONG && y->type == LVAL_LONG) ? LVAL_LONG : LVAL_DOUBLE;
-
-		if (strcmp(op, "+")    == 0) { lval_updateData(x, lval_getData(x) + lval_getData(y), resultType); }
-		if (strcmp(op, "-")   == 0) {  lval_updateData(x, lval_getData(x) - lval_getData(y), resultType); }
-		if (strcmp(op, "*")   == 0) {  lval_updateData(x, lval_getData(x) * lval_getData(y), resultType); }
-		if (strcmp(op, "/")   == 0) { 
-			if (lval_getData(y) == 0) { return lval_err("Divide by Zero"); }
-			 lval_updateData(x, lval_getData(x) / lval_getData(y), resultType); 
-		}
-		if (strcmp(op, "min") == 0) { lval_updateData(x, min(lval_getData(x), lval_getData(y)), resultType); }
-		if (strcmp(op, "max") == 0) { lval_updateData(x, max(lval_getData(x), lval_getData(y)), resultType); }
-		if (strcmp(op, "^")   == 0) { lval_updateData(x, pow(lval_getData(x), lval_getData(y)), resultType); }
-		if (strcmp(op, "%")   == 0) { lval_updateData(x, fmod(lval_getData(x), lval_getData(y)), resultType); }
-		lval_del(y);
-	}
-
-	lval_del(a);
-	return x;
-}